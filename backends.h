@@ -0,0 +1,14 @@
+#ifndef BACKENDS_H
+#define BACKENDS_H
+
+// Entry points of the execution engines. Each one takes the command line of
+// the program it is built into on its own (argv[0] included) and returns its
+// exit status; the floyd driver links them all and picks one with --backend.
+int RunOMP(int argc, char* argv[]);
+int RunWavefront(int argc, char* argv[]);
+int RunThreads(int argc, char* argv[]);
+int RunMPI(int argc, char* argv[]);
+int RunMPIOMP(int argc, char* argv[]);
+int RunMPIThreads(int argc, char* argv[]);
+
+#endif
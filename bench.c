@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "ppm.h"
+#include "bench.h"
+
+typedef struct {
+    const char *name;
+    double current;             // ms in the run going on
+    double *samples;            // one per measured run
+} BenchPhase;
+
+static struct {
+    int active, iterations, warmup, run;
+    int numPhases, depth;
+    BenchPhase phases[BENCH_MAX_PHASES];
+    int stack[BENCH_MAX_PHASES];
+    struct timespec since;      // when the phase on top of the stack last resumed
+} bench;
+
+static double ms_since(const struct timespec *since, struct timespec *now) {
+    clock_gettime(CLOCK_MONOTONIC, now);
+    return (now->tv_sec - since->tv_sec) * 1000.0 + (now->tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+int BenchStart(void) {
+    const char *spec = getenv("DITHER_BENCH");
+    char *comma;
+
+    if (!spec)
+        return 0;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.iterations = atoi(spec);
+    comma = strchr(spec, ',');
+    bench.warmup = comma ? atoi(comma + 1) : 1;
+    if (bench.iterations < 1 || bench.warmup < 0) {
+         fprintf(stderr, "Invalid DITHER_BENCH '%s' (iterations[,warmup])\n", spec);
+         exit(1);
+    }
+    bench.active = 1;
+
+    return 1;
+}
+
+int BenchRunning(void) {
+    return bench.active;
+}
+
+static int find_phase(const char *name) {
+    int i;
+
+    for (i = 0; i < bench.numPhases; i++) {
+        if (strcmp(bench.phases[i].name, name) == 0)
+            return i;
+    }
+    if (bench.numPhases == BENCH_MAX_PHASES) {
+         fprintf(stderr, "More than %d benchmark phases\n", BENCH_MAX_PHASES);
+         exit(1);
+    }
+
+    bench.phases[i].name = name;
+    bench.phases[i].current = 0;
+    bench.phases[i].samples = (double*)calloc(bench.iterations, sizeof(double));
+    if (!bench.phases[i].samples) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    bench.numPhases++;
+
+    return i;
+}
+
+void BenchBegin(const char *phase) {
+    struct timespec now;
+    int index;
+
+    if (!bench.active)
+        return;
+    index = find_phase(phase);
+    if (bench.depth == BENCH_MAX_PHASES) {
+         fprintf(stderr, "Benchmark phases nested too deep\n");
+         exit(1);
+    }
+
+    // the enclosing phase stops counting while this one runs
+    if (bench.depth > 0)
+        bench.phases[bench.stack[bench.depth - 1]].current += ms_since(&bench.since, &now);
+    else
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    bench.stack[bench.depth++] = index;
+    bench.since = now;
+}
+
+void BenchEnd(void) {
+    struct timespec now;
+
+    if (!bench.active || bench.depth == 0)
+        return;
+    bench.phases[bench.stack[--bench.depth]].current += ms_since(&bench.since, &now);
+    bench.since = now;
+}
+
+int BenchNext(void) {
+    int i;
+
+    if (!bench.active)
+        return 0;
+    for (i = 0; i < bench.numPhases; i++) {
+        if (bench.run >= bench.warmup)
+            bench.phases[i].samples[bench.run - bench.warmup] = bench.phases[i].current;
+        bench.phases[i].current = 0;
+    }
+    bench.depth = 0;
+    bench.run++;
+
+    return bench.run < bench.warmup + bench.iterations;
+}
+
+void BenchReadPPM(const char *filename) {
+    RGBImage *image;
+
+    BenchBegin("read");
+    if (getenv("DITHER_MMAP")) {
+        image = mapPPM(filename);
+        unmapPPM(image);
+    } else {
+        image = readPPM(filename);
+        free(image->pixels);
+        free(image);
+    }
+    BenchEnd();
+}
+
+// a JSON string literal: quotes, backslashes and control characters escaped
+static void put_json_string(FILE *fp, const char *s) {
+    putc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        else
+            putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void BenchReport(const char *backend, long pixels, int print) {
+    const char *out = getenv("DITHER_BENCH_OUT");
+    const char *label = getenv("DITHER_BENCH_LABEL");
+    int n = bench.iterations, json = 0, i, k;
+    double min, median, p95, mean, stddev, rate;
+    FILE *fp = NULL;
+
+    if (!bench.active)
+        return;
+    bench.active = 0;
+    if (!label)
+        label = "";
+
+    if (print && out) {
+        json = strlen(out) > 5 && strcmp(out + strlen(out) - 5, ".json") == 0;
+        fp = fopen(out, "a");
+        if (!fp) {
+             fprintf(stderr, "Unable to open file '%s'\n", out);
+             exit(1);
+        }
+        if (!json && ftell(fp) == 0)
+            fprintf(fp, "label,backend,phase,iterations,warmup,pixels,min_ms,median_ms,p95_ms,stddev_ms,mpixels_per_s\n");
+    }
+    if (print)
+        fprintf(stderr, "BENCH %s, %d runs after %d warmup, %ld pixels\n"
+                "%-12s %10s %10s %10s %10s %10s\n", backend, n, bench.warmup, pixels,
+                "phase", "min ms", "median ms", "p95 ms", "stddev ms", "Mpixels/s");
+
+    for (i = 0; i < bench.numPhases; i++) {
+        double *s = bench.phases[i].samples;
+
+        qsort(s, n, sizeof(double), compare_doubles);
+        min = s[0];
+        median = n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2;
+        p95 = s[(int)ceil(0.95 * n) - 1];
+        mean = 0;
+        for (k = 0; k < n; k++)
+            mean += s[k];
+        mean /= n;
+        stddev = 0;
+        for (k = 0; k < n; k++)
+            stddev += (s[k] - mean) * (s[k] - mean);
+        stddev = n > 1 ? sqrt(stddev / (n - 1)) : 0;
+        rate = median > 0 ? pixels / (median * 1000.0) : 0;
+
+        if (print)
+            fprintf(stderr, "%-12s %10.3lf %10.3lf %10.3lf %10.3lf %10.2lf\n",
+                    bench.phases[i].name, min, median, p95, stddev, rate);
+        if (fp && json) {
+            fprintf(fp, "{\"label\": ");
+            put_json_string(fp, label);
+            fprintf(fp, ", \"backend\": \"%s\", \"phase\": \"%s\", \"iterations\": %d, "
+                    "\"warmup\": %d, \"pixels\": %ld, \"min_ms\": %.6lf, \"median_ms\": %.6lf, "
+                    "\"p95_ms\": %.6lf, \"stddev_ms\": %.6lf, \"mpixels_per_s\": %.6lf}\n",
+                    backend, bench.phases[i].name, n, bench.warmup, pixels,
+                    min, median, p95, stddev, rate);
+        } else if (fp)
+            fprintf(fp, "%s,%s,%s,%d,%d,%ld,%.6lf,%.6lf,%.6lf,%.6lf,%.6lf\n",
+                    label, backend, bench.phases[i].name, n, bench.warmup, pixels,
+                    min, median, p95, stddev, rate);
+        free(s);
+    }
+
+    if (fp)
+        fclose(fp);
+}
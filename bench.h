@@ -0,0 +1,42 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Benchmark mode (DITHER_BENCH=iterations[,warmup]). After its normal run,
+// every backend repeats the read, the dither call and the write in process:
+// warmup runs first (1 by default), whose times are dropped, then
+// `iterations` measured runs. Times are kept per phase:
+//
+//   read          loading the input, or reading it with MPI-IO
+//   compute       the dither call, minus the other phases nested in it
+//   communicate   scatter, gather and error-row messages between ranks
+//   write         writing the palettized output
+//
+// Phases nest, and a phase's time excludes the phases opened inside it, so
+// every backend's compute is the dithering alone whatever its call also does.
+// BenchReport prints min, median, p95, standard deviation and Mpixels/s (at
+// the median) of every phase on stderr. With DITHER_BENCH_OUT=file.csv it
+// also appends one CSV row per phase, and with file.json one JSON object per
+// line; DITHER_BENCH_LABEL (a commit id, say) goes into every row.
+#define BENCH_MAX_PHASES 8
+
+// starts the loop when DITHER_BENCH is set; returns 0 otherwise
+int BenchStart(void);
+// closes the current run; returns 0 after the last one
+int BenchNext(void);
+
+// nonzero inside the loop, where the per-run TIME, WRITE TIME and per-rank
+// lines stay quiet and only BenchReport prints
+int BenchRunning(void);
+
+// no-ops outside the loop; only the thread that called BenchStart may use them
+void BenchBegin(const char *phase);
+void BenchEnd(void);
+
+// the read phase for backends that load the whole file themselves: the
+// input is loaded as the backend loads it (DITHER_MMAP) and released again
+void BenchReadPPM(const char *filename);
+
+// prints (when `print` is set) and stores the statistics, then ends the loop
+void BenchReport(const char *backend, long pixels, int print);
+
+#endif
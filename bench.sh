@@ -0,0 +1,83 @@
+#!/bin/bash
+# ./bench.sh image.ppm [iterations] [warmup]
+# Every backend of the floyd driver, timed in process by its own benchmark
+# mode (see bench.h) instead of being launched N times and averaged with bc.
+# Rows are appended to bench.csv, labelled with the current commit, so runs
+# of different commits can be compared. The true diffusion backends then run
+# again in raster and in serpentine order (DITHER_SERPENTINE), labelled
+# commit:order:workers, and the serpentine slowdown is printed per backend.
+# In serpentine order every row waits for the whole row above, so those
+# backends run serially and the slowdown is the parallelism that is lost.
+
+make floyd
+
+DIR="./images/"
+FILE=$DIR$1
+export DITHER_BENCH="${2:-10},${3:-2}"
+export DITHER_BENCH_OUT="bench.csv"
+export DITHER_BENCH_LABEL=`git rev-parse --short HEAD 2>/dev/null`
+
+./floyd --backend=serial $FILE > /dev/null
+
+for t in 1 2 4 8;
+do
+	export OMP_NUM_THREADS=$t
+	./floyd --backend=omp $FILE > /dev/null
+	./floyd --backend=omp $FILE tasks > /dev/null
+	./floyd --backend=wavefront $FILE > /dev/null
+	./floyd --backend=pthreads $t $FILE > /dev/null
+	./floyd --backend=pthreads $t $FILE pipeline > /dev/null
+	./floyd --backend=pthreads $t $FILE steal > /dev/null
+	mpirun -n $t ./floyd --backend=mpi $FILE > /dev/null
+	mpirun -n $t ./floyd --backend=mpi $FILE pipeline > /dev/null
+	mpirun -n $t ./floyd --backend=mpi $FILE overlap > /dev/null
+done
+export OMP_NUM_THREADS=2
+for p in 1 2 4;
+do
+	mpirun -n $p ./floyd --backend=mpi+omp $FILE > /dev/null
+	mpirun -n $p ./floyd --backend=mpi+threads 2 $FILE > /dev/null
+done
+
+LABEL=$DITHER_BENCH_LABEL
+for t in 1 2 4 8;
+do
+	export OMP_NUM_THREADS=$t
+	for order in raster serpentine;
+	do
+		export DITHER_BENCH_LABEL="$LABEL:$order:$t"
+		if [ $order = serpentine ]; then
+			export DITHER_SERPENTINE=1
+		else
+			unset DITHER_SERPENTINE
+		fi
+		./floyd --backend=omp $FILE tasks > /dev/null
+		./floyd --backend=pthreads $t $FILE pipeline > /dev/null
+		./floyd --backend=wavefront $FILE > /dev/null
+		mpirun -n $t ./floyd --backend=mpi $FILE pipeline > /dev/null
+	done
+done
+unset DITHER_SERPENTINE
+
+# compute plus communicate medians of this commit's latest runs
+echo "serpentine order is serial: every row waits for the whole row above"
+printf "backend\tworkers\traster_ms\tserpentine_ms\tslowdown\n"
+awk -F, -v label="$LABEL" '
+	index($1, label ":") == 1 && ($3 == "compute" || $3 == "communicate") {
+		split(substr($1, length(label) + 2), l, ":")
+		t[l[1] "," $2 "," l[2] "," $3] = $8
+	}
+	END {
+		for (k in t) {
+			split(k, f, ",")
+			if (f[1] == "raster" && f[4] == "compute") {
+				r = f[2] "," f[3]
+				raster = t[k] + t["raster," r ",communicate"]
+				serp = t["serpentine," r ",compute"] + t["serpentine," r ",communicate"]
+				if (serp > 0)
+					printf "%s\t%s\t%.3f\t%.3f\t%.2fx\n", f[2], f[3], raster, serp, serp / raster
+			}
+		}
+	}' $DITHER_BENCH_OUT | sort -k1,1 -k2,2n
+
+echo "results appended to $DITHER_BENCH_OUT"
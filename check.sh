@@ -0,0 +1,54 @@
+#!/bin/bash
+# ./check.sh
+# Runs every engine of the floyd driver in check mode (a byte-for-byte
+# comparison with the serial reference, see CheckResult) on synthetic images,
+# for every kernel. The 3x5 image gives the MPI pipeline more ranks than its
+# rows can feed with the taller kernels' halo. Prints the failing runs and
+# exits with 1 if there are any.
+
+make floyd synth
+
+MPIRUN=${MPIRUN:-"mpirun --oversubscribe"}
+TMP=`mktemp -d`
+trap "rm -rf $TMP" EXIT
+FAILED=0
+
+./synth 157 93 $TMP/small.ppm
+./synth 3 5 $TMP/tiny.ppm
+
+check() {
+	if ! "$@" 2>&1 | grep -q "CHECK = OK"; then
+		echo "FAILED: DITHER_KERNEL=$DITHER_KERNEL $*"
+		FAILED=1
+	fi
+}
+
+cd $TMP
+for kernel in floyd jjn stucki sierra atkinson;
+do
+	export DITHER_KERNEL=$kernel
+	export OMP_NUM_THREADS=3
+	for image in small.ppm tiny.ppm;
+	do
+		check $OLDPWD/floyd --backend=omp $image check
+		check $OLDPWD/floyd --backend=omp $image tasks check
+		check $OLDPWD/floyd --backend=wavefront $image check
+		check $OLDPWD/floyd --backend=pthreads 3 $image check
+		check $OLDPWD/floyd --backend=pthreads 3 $image pipeline check
+		check $OLDPWD/floyd --backend=pthreads 3 $image steal check
+		for p in 2 4 6;
+		do
+			check $MPIRUN -n $p $OLDPWD/floyd --backend=mpi $image check
+			check $MPIRUN -n $p $OLDPWD/floyd --backend=mpi $image pipeline check
+			check $MPIRUN -n $p $OLDPWD/floyd --backend=mpi $image overlap check
+			check $MPIRUN -n $p $OLDPWD/floyd --backend=mpi+omp $image check
+			check $MPIRUN -n $p $OLDPWD/floyd --backend=mpi+threads 2 $image check
+		done
+	done
+done
+cd $OLDPWD
+
+if [ $FAILED = 0 ]; then
+	echo "all checks passed"
+fi
+exit $FAILED
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dither.h"
+#include "prof.h"
+
+// pixels per DitherSpan call in DitherNearest, so a span's width fits an int
+#define NEAREST_SPAN 65536
+
+#define plus_truncate_uchar(a, b) \
+    if (((int)(a)) + (b) < 0) \
+        (a) = 0; \
+    else if (((int)(a)) + (b) > 255) \
+        (a) = 255; \
+    else \
+        (a) += (b);
+
+// error * weight / divisor rounded down, as the arithmetic shift of the
+// original 7/3/5/1 weights did; the divisor is a constant in every span, so
+// this folds to that shift for powers of two
+#define scale_error(e, weight, divisor) \
+    (((divisor) & ((divisor) - 1)) == 0 ? ((e) * (weight)) >> __builtin_ctz(divisor) : \
+     (e) * (weight) >= 0 ? (e) * (weight) / (divisor) : -((-(e) * (weight) + (divisor) - 1) / (divisor)))
+
+// taps in row-major order: tap(dx, dy, weight)
+#define FLOYD_STEINBERG_TAPS(tap) \
+    tap(1, 0, 7) \
+    tap(-1, 1, 3) tap(0, 1, 5) tap(1, 1, 1)
+#define JARVIS_JUDICE_NINKE_TAPS(tap) \
+    tap(1, 0, 7) tap(2, 0, 5) \
+    tap(-2, 1, 3) tap(-1, 1, 5) tap(0, 1, 7) tap(1, 1, 5) tap(2, 1, 3) \
+    tap(-2, 2, 1) tap(-1, 2, 3) tap(0, 2, 5) tap(1, 2, 3) tap(2, 2, 1)
+#define STUCKI_TAPS(tap) \
+    tap(1, 0, 8) tap(2, 0, 4) \
+    tap(-2, 1, 2) tap(-1, 1, 4) tap(0, 1, 8) tap(1, 1, 4) tap(2, 1, 2) \
+    tap(-2, 2, 1) tap(-1, 2, 2) tap(0, 2, 4) tap(1, 2, 2) tap(2, 2, 1)
+#define SIERRA_TAPS(tap) \
+    tap(1, 0, 5) tap(2, 0, 3) \
+    tap(-2, 1, 2) tap(-1, 1, 4) tap(0, 1, 5) tap(1, 1, 4) tap(2, 1, 2) \
+    tap(-1, 2, 2) tap(0, 2, 3) tap(1, 2, 2)
+// only 6/8 of the error is passed on
+#define ATKINSON_TAPS(tap) \
+    tap(1, 0, 1) tap(2, 0, 1) \
+    tap(-1, 1, 1) tap(0, 1, 1) tap(1, 1, 1) \
+    tap(0, 2, 1)
+// none of it is: every pixel just gets its nearest entry, which is all the
+// legacy modes of the backends ever computed
+#define NEAREST_TAPS(tap)
+
+#define diffuse_tap(dx, dy, weight) \
+    if ((dy) <= rowsBelow && ((dx) >= 0 || x >= -(dx)) && ((dx) <= 0 || x + (dx) < width)) { \
+        target = currentPixel + (long)(dy) * width + (dx); \
+        plus_truncate_uchar(target->R, scale_error(error[0], weight, divisor)); \
+        plus_truncate_uchar(target->G, scale_error(error[1], weight, divisor)); \
+        plus_truncate_uchar(target->B, scale_error(error[2], weight, divisor)); \
+    }
+
+// the same tap, mirrored for a row that runs right to left
+#define mirror_tap(dx, dy, weight) diffuse_tap(-(dx), dy, weight)
+
+#define dither_pixel(TAPS, tap) \
+        currentPixel = row + x; \
+        index = FindNearestColor(*currentPixel, palette); \
+        error[0] = ((int)(currentPixel->R)) - palette.table[index].R; \
+        error[1] = ((int)(currentPixel->G)) - palette.table[index].G; \
+        error[2] = ((int)(currentPixel->B)) - palette.table[index].B; \
+        TAPS(tap) \
+        result[x] = index;
+
+// one span loop per kernel and direction, with the taps unrolled and every
+// weight, offset and divisor a constant (a kernel without taps leaves the
+// error and the divisor unused)
+#define define_span(name, TAPS, div) \
+static void name(RGBTriple *row, int width, int rowsBelow, int x0, int x1, int reverse, \
+                 RGBPalette palette, unsigned char *result) { \
+    const int divisor __attribute__((unused)) = (div); \
+    RGBTriple *currentPixel, *target __attribute__((unused)); \
+    unsigned char index; \
+    int x, error[3] __attribute__((unused)); \
+    \
+    if (reverse) { \
+        for (x = x1 - 1; x >= x0; x--) { \
+            dither_pixel(TAPS, mirror_tap) \
+        } \
+    } else { \
+        for (x = x0; x < x1; x++) { \
+            dither_pixel(TAPS, diffuse_tap) \
+        } \
+    } \
+}
+
+define_span(span_floyd_steinberg, FLOYD_STEINBERG_TAPS, 16)
+define_span(span_jarvis_judice_ninke, JARVIS_JUDICE_NINKE_TAPS, 48)
+define_span(span_stucki, STUCKI_TAPS, 42)
+define_span(span_sierra, SIERRA_TAPS, 32)
+define_span(span_atkinson, ATKINSON_TAPS, 8)
+define_span(span_nearest, NEAREST_TAPS, 1)
+
+#define table_tap(dx, dy, weight) {dx, dy, weight},
+#define count_tap(dx, dy, weight) + 1
+
+#define kernel_entry(name, TAPS, rows, divisor, span) \
+    {name, rows, divisor, 0 TAPS(count_tap), {TAPS(table_tap)}, span}
+
+static const DitherKernel KERNELS[] = {
+    kernel_entry("floyd", FLOYD_STEINBERG_TAPS, 2, 16, span_floyd_steinberg),
+    kernel_entry("jjn", JARVIS_JUDICE_NINKE_TAPS, 3, 48, span_jarvis_judice_ninke),
+    kernel_entry("stucki", STUCKI_TAPS, 3, 42, span_stucki),
+    kernel_entry("sierra", SIERRA_TAPS, 3, 32, span_sierra),
+    kernel_entry("atkinson", ATKINSON_TAPS, 3, 8, span_atkinson),
+    kernel_entry("nearest", NEAREST_TAPS, 1, 1, span_nearest),
+};
+
+const DitherKernel *FindKernel(const char *name) {
+    int i;
+
+    for (i = 0; i < (int)(sizeof(KERNELS) / sizeof(KERNELS[0])); i++) {
+        if (strcmp(KERNELS[i].name, name) == 0)
+            return &KERNELS[i];
+    }
+    return NULL;
+}
+
+const DitherKernel *loadKernel(void) {
+    const char *name = getenv("DITHER_KERNEL");
+    const DitherKernel *kernel;
+
+    if (!name)
+        return &KERNELS[0];
+    kernel = FindKernel(name);
+    if (!kernel) {
+         fprintf(stderr, "Unknown DITHER_KERNEL '%s' (floyd, jjn, stucki, sierra, atkinson or nearest)\n", name);
+         exit(1);
+    }
+    return kernel;
+}
+
+int KernelLag(const DitherKernel *kernel) {
+    int left[MAX_KERNEL_ROWS], right[MAX_KERNEL_ROWS];
+    int i, d, k, reach, lag = 1;
+
+    // how far left and right of the pixel the taps reach in each row; the
+    // pixel itself counts on its own row, since it is read there
+    for (d = 0; d < kernel->rows; d++)
+        left[d] = right[d] = 0;
+    for (i = 0; i < kernel->numTaps; i++) {
+        d = kernel->taps[i].dy;
+        if (-kernel->taps[i].dx > left[d])
+            left[d] = -kernel->taps[i].dx;
+        if (kernel->taps[i].dx > right[d])
+            right[d] = kernel->taps[i].dx;
+    }
+
+    // row r+k at column x touches row r+k+d up to x + right[d], where row r
+    // must be done pushing: its pixels up to x + right[d] + left[k+d]
+    for (k = 1; k < kernel->rows; k++) {
+        for (d = 0; d + k < kernel->rows; d++) {
+            reach = right[d] + left[k + d] + 1;
+            if ((reach + k - 1) / k > lag)
+                lag = (reach + k - 1) / k;
+        }
+    }
+
+    return lag;
+}
+
+void DitherSpan(const DitherKernel *kernel, RGBTriple *row, int width, int rowsBelow,
+                int x0, int x1, int reverse, RGBPalette palette, unsigned char *result) {
+    ProfBegin(PROF_KERNEL);
+    kernel->span(row, width, rowsBelow, x0, x1, reverse, palette, result);
+    ProfEnd(PROF_KERNEL);
+}
+
+void DitherNearest(RGBTriple *pixels, long count, RGBPalette palette, unsigned char *result) {
+    const DitherKernel *nearest = FindKernel("nearest");
+    long k;
+    int n;
+
+    for (k = 0; k < count; k += n) {
+        n = count - k < NEAREST_SPAN ? count - k : NEAREST_SPAN;
+        DitherSpan(nearest, pixels + k, n, 0, 0, n, 0, palette, result + k);
+    }
+}
+
+int SerpentineScan(void) {
+    return getenv("DITHER_SERPENTINE") != NULL;
+}
+
+void BandRows(int height, int parts, int part, int *first, int *rows) {
+    int extra = height % parts;
+
+    *rows = height / parts + (part < extra);
+    *first = part * (height / parts) + (part < extra ? part : extra);
+}
+
+static double part_weight(const char *list, int part) {
+    const char *p = list;
+    char *end;
+    double weight = 1;
+    int i;
+
+    for (i = 0; i <= part && *p; i++) {
+        weight = strtod(p, &end);
+        if (end == p || weight <= 0) {
+             fprintf(stderr, "Invalid DITHER_WEIGHTS '%s'\n", list);
+             exit(1);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return i > part ? weight : 1;
+}
+
+void WeightedBandRows(int height, int parts, int part, int *first, int *rows) {
+    const char *list = getenv("DITHER_WEIGHTS");
+    double before = 0, total = 0, weight;
+    int i, last;
+
+    if (!list) {
+        BandRows(height, parts, part, first, rows);
+        return;
+    }
+
+    for (i = 0; i < parts; i++) {
+        weight = part_weight(list, i);
+        if (i < part)
+            before += weight;
+        total += weight;
+    }
+    weight = part < parts ? part_weight(list, part) : 0;
+
+    *first = (int)(height * before / total + 0.5);
+    last = (int)(height * (before + weight) / total + 0.5);
+    *rows = last - *first;
+}
+
+void MinBandRows(int height, int parts, int part, int minRows, int *first, int *rows) {
+    int active, i, f, r;
+
+    for (active = parts; active > 1; active--) {
+        for (i = 0; i < active; i++) {
+            WeightedBandRows(height, active, i, &f, &r);
+            if (r > 0 && r < minRows)
+                break;
+        }
+        if (i == active)
+            break;
+    }
+
+    if (part < active) {
+        WeightedBandRows(height, active, part, first, rows);
+    } else {
+        *first = height;
+        *rows = 0;
+    }
+}
+
+int NumaLocal(void) {
+    const char *numa = getenv("DITHER_NUMA");
+
+    return numa && strcmp(numa, "local") == 0;
+}
+
+PalettizedImage DitherSerial(RGBImage image, RGBPalette palette, const DitherKernel *kernel, int serpentine) {
+    PalettizedImage result;
+    RGBTriple *pixels;
+    long size;
+    int y;
+
+    result.width = image.width;
+    result.height = image.height;
+    size = (long)image.width * image.height;
+    result.pixels = (unsigned char*)malloc(sizeof(unsigned char) * size);
+
+    // the error is pushed into the pixels, so work on a copy of the input
+    pixels = (RGBTriple*)malloc(size * sizeof(RGBTriple));
+    if (!result.pixels || !pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    memcpy(pixels, image.pixels, size * sizeof(RGBTriple));
+
+    for (y = 0; y < image.height; y++) {
+        DitherSpan(kernel, pixels + (long)y * image.width, image.width, image.height - 1 - y,
+                   0, image.width, serpentine && (y & 1), palette, result.pixels + (long)y * image.width);
+    }
+
+    free(pixels);
+    return result;
+}
+
+void RunWorkersSerial(int workers, WorkFunc work, void *arg) {
+    int id;
+
+    for (id = 0; id < workers; id++)
+        work(arg, id);
+}
+
+int CheckArgument(int *argc, char *argv[]) {
+    if (*argc > 2 && strcmp(argv[*argc - 1], "check") == 0) {
+        (*argc)--;
+        return 1;
+    }
+    return 0;
+}
+
+int CheckResult(PalettizedImage result, RGBImage image, RGBPalette palette, const DitherKernel *kernel,
+                int serpentine) {
+    PalettizedImage reference = DitherSerial(image, palette, kernel, serpentine);
+    long k, size = (long)result.width * result.height;
+
+    for (k = 0; k < size && reference.pixels[k] == result.pixels[k]; k++)
+        ;
+    if (k == size)
+        fprintf(stderr, "CHECK = OK\n");
+    else
+        fprintf(stderr, "CHECK = MISMATCH at pixel %ld\n", k);
+    free(reference.pixels);
+
+    return k == size;
+}
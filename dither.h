@@ -0,0 +1,131 @@
+#ifndef DITHER_H
+#define DITHER_H
+
+typedef struct {
+    unsigned char R, G, B;
+} RGBTriple;
+
+typedef struct {
+    int size;
+    RGBTriple* table;
+    struct PaletteSearch *search;   // set up by PaletteSearchInit
+} RGBPalette;
+
+typedef struct {
+    int width, height;
+    RGBTriple* pixels;
+} RGBImage;
+
+typedef struct {
+    int width, height;
+    unsigned char* pixels;
+} PalettizedImage;
+
+#define MAX_KERNEL_ROWS 3
+#define MAX_KERNEL_TAPS 12
+
+// row r+1 may dither column x only once row r has finished columns [0, x + DITHER_LAG):
+// row r still adds 3/16 to (x+1, r+1) while it works on column x+2. That is
+// Floyd-Steinberg's; KernelLag gives every kernel's own
+#define DITHER_LAG 3
+
+// (x + dx, y + dy) gets weight / divisor of the error of pixel (x, y)
+typedef struct {
+    int dx, dy, weight;
+} DitherTap;
+
+// dithers columns [x0, x1) of the row at `row`, right to left with the
+// kernel mirrored when reverse is set; the rows below it follow at a stride of
+// width pixels, rowsBelow of them (0 on the last row)
+typedef void (*DitherSpanFunc)(RGBTriple *row, int width, int rowsBelow, int x0, int x1, int reverse,
+                               RGBPalette palette, unsigned char *result);
+
+// an error-diffusion kernel: its taps in row-major order, the rows they span
+// (the current one included), and a span loop compiled for these taps alone
+typedef struct {
+    const char *name;
+    int rows, divisor, numTaps;
+    DitherTap taps[MAX_KERNEL_TAPS];
+    DitherSpanFunc span;
+} DitherKernel;
+
+// floyd (the default), jjn (Jarvis-Judice-Ninke), stucki, sierra, atkinson or
+// nearest (no diffusion at all); NULL for any other name
+const DitherKernel *FindKernel(const char *name);
+
+// the kernel named by DITHER_KERNEL, or Floyd-Steinberg
+const DitherKernel *loadKernel(void);
+
+// columns a row has to stay behind the row above: rows r and r+k may run
+// together once row r is k * lag columns ahead, far enough that nothing row r
+// still pushes down (as far left as the taps reach) lands where row r+k reads
+// or pushes (as far right as they reach). DITHER_LAG for Floyd-Steinberg.
+int KernelLag(const DitherKernel *kernel);
+
+// nearest palette entry (lowest index on ties), see palette_search.c
+unsigned char FindNearestColor(RGBTriple color, RGBPalette palette);
+
+// dithers columns [x0, x1) of one row with the kernel, pushing the error right
+// along the row and into the rowsBelow rows that follow it in memory; reverse
+// runs right to left and pushes the error left instead
+void DitherSpan(const DitherKernel *kernel, RGBTriple *row, int width, int rowsBelow,
+                int x0, int x1, int reverse, RGBPalette palette, unsigned char *result);
+
+// the nearest palette entry of each of count pixels, with the nearest kernel
+// over them as one long row: what the legacy modes of the backends compute on
+// their share of the image. The pixels are only read.
+void DitherNearest(RGBTriple *pixels, long count, RGBPalette palette, unsigned char *result);
+
+// DITHER_SERPENTINE set: odd rows run right to left with the kernel mirrored.
+// A row then needs the whole row above before it starts, in either direction,
+// so the parallel engines run it as whole rows one after another
+int SerpentineScan(void);
+
+// rows [*first, *first + *rows) of a height-row image go to part `part` of
+// `parts`; the first height % parts parts get one extra row
+void BandRows(int height, int parts, int part, int *first, int *rows);
+
+// BandRows with the rows shared in proportion to DITHER_WEIGHTS, one relative
+// speed per part ("1,1,2" gives the third part half the rows), so parts of
+// different speed finish together; missing weights count as 1 and without
+// DITHER_WEIGHTS the bands are even
+void WeightedBandRows(int height, int parts, int part, int *first, int *rows);
+
+// WeightedBandRows over as many of the first parts as can each get at least
+// minRows rows (or none); the parts past them get no rows, at the end
+void MinBandRows(int height, int parts, int part, int minRows, int *first, int *rows);
+
+// DITHER_NUMA=local: every worker gets the same band on every call and
+// first-touches that band's input copy, result and working rows itself, so on
+// a multi-socket machine the pages end up on the worker's own node
+int NumaLocal(void);
+
+// Runs work(arg, id) once for every id in [0, workers) on the backend's own
+// threads. The setup and output steps every backend shares (SetupPalette,
+// writePal) hand out their work through one, so a backend only says how its
+// threads are started; the work itself never waits on another id.
+typedef void (*WorkFunc)(void *arg, int id);
+typedef void (*RunWorkersFunc)(int workers, WorkFunc work, void *arg);
+
+// every id in turn on the calling thread
+void RunWorkersSerial(int workers, WorkFunc work, void *arg);
+
+// the ids spread over an OpenMP team; only linked into the OpenMP binaries
+// (workers_omp.c)
+void RunWorkersOMP(int workers, WorkFunc work, void *arg);
+
+// serial reference every parallel engine must match bit for bit, in raster or
+// serpentine order
+PalettizedImage DitherSerial(RGBImage image, RGBPalette palette, const DitherKernel *kernel, int serpentine);
+
+// The `check` mode of the engines. CheckArgument drops a trailing "check"
+// from the command line, so the engine's own arguments parse as before, and
+// says whether it was there. CheckResult compares a result with DitherSerial
+// on the same input (the nearest kernel for the nearest-colour modes), prints
+// CHECK = OK or the first pixel that differs on stderr, and returns 1 on a
+// match.
+int CheckArgument(int *argc, char *argv[]);
+int CheckResult(PalettizedImage result, RGBImage image, RGBPalette palette, const DitherKernel *kernel,
+                int serpentine);
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dither.h"
+#include "palette.h"
+#include "ppm.h"
+#include "bench.h"
+#include "prof.h"
+#include "backends.h"
+
+#define OUTPUT_FILE "outserial.ppm"
+
+typedef struct {
+    const char *name;
+    int (*run)(int argc, char* argv[]);
+    const char *args;
+} Backend;
+
+static int RunSerial(int argc, char* argv[]);
+
+static const Backend BACKENDS[] = {
+    {"serial",      &RunSerial,     "input"},
+    {"omp",         &RunOMP,        "input [tasks [block_width [tile_rows]]] [check]"},
+    {"wavefront",   &RunWavefront,  "input [block_width] [check]"},
+    {"pthreads",    &RunThreads,    "num_threads input [pipeline [lag] | steal [tile_rows]] [check]"},
+    {"mpi",         &RunMPI,        "input [pipeline [block_width] | overlap [chunks]] [check]"},
+    {"mpi+omp",     &RunMPIOMP,     "input [check]"},
+    {"mpi+threads", &RunMPIThreads, "num_threads input [steal [tile_rows]] [check]"},
+};
+
+#define NUM_BACKENDS (int)(sizeof(BACKENDS) / sizeof(BACKENDS[0]))
+
+// the raster-order reference on one core, same inputs and options as the
+// parallel engines
+static int RunSerial(int argc, char* argv[]) {
+    struct timeval t1, t2;
+    double elapsedTime;
+    RGBImage *image;
+    RGBPalette palette;
+    PalettizedImage result;
+    const DitherKernel *kernel = loadKernel();
+    int serpentine = SerpentineScan();
+    int mapped;
+
+    const char *input = argv[1];
+
+    if (argc != 2) {
+        printf("call <floyd> --backend=serial input\n");
+        exit(1);
+    }
+
+    palette = loadPalette();
+    ProfStart();
+
+    gettimeofday(&t1, NULL);
+    mapped = getenv("DITHER_MMAP") != NULL;
+    image = mapped ? mapPPM(argv[1]) : readPPM(argv[1]);
+    reportLoad(&t1);
+
+    SetupPalette(&palette, *image, 1, RunWorkersSerial);
+
+    printf("Serial ");
+    gettimeofday(&t1, NULL);
+    result = DitherSerial(*image, palette, kernel, serpentine);
+    gettimeofday(&t2, NULL);
+
+    elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
+    elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
+    printf ("TIME = %lf\n", elapsedTime);
+    ProfReport("Serial", -1);
+    writePalFile(OUTPUT_FILE, palette, result);
+
+    // DITHER_BENCH: the same read, dither and write again, with per-phase statistics
+    if (BenchStart()) {
+        do {
+            free(result.pixels);
+            BenchReadPPM(input);
+            BenchBegin("compute");
+            result = DitherSerial(*image, palette, kernel, serpentine);
+            BenchEnd();
+            BenchBegin("write");
+            writePalFile(OUTPUT_FILE, palette, result);
+            BenchEnd();
+        } while (BenchNext());
+        BenchReport("Serial", (long)image->width * image->height, 1);
+    }
+
+    if (mapped) {
+        unmapPPM(image);
+    } else {
+        free(image->pixels);
+        free(image);
+    }
+    free(result.pixels);
+
+    return 0;
+}
+
+static void usage(void) {
+    int i;
+
+    printf("call <floyd> --backend=<name> <args>, where name and args are one of\n");
+    for (i = 0; i < NUM_BACKENDS; i++)
+        printf("    %-12s %s\n", BACKENDS[i].name, BACKENDS[i].args);
+    printf("DITHER_SERPENTINE=1 runs odd rows right to left. Every row then waits for\n"
+           "the whole row above, so omp tasks, wavefront, pthreads pipeline and mpi\n"
+           "pipeline run one row at a time: in serpentine order they are serial.\n");
+    exit(1);
+}
+
+// floyd --backend=<name> <args>: the backend gets the rest of the command
+// line exactly as its standalone program would, with argv[0] kept
+int main(int argc, char* argv[]) {
+    const char *name;
+    int i;
+
+    if (argc < 2 || strncmp(argv[1], "--backend=", 10) != 0)
+        usage();
+
+    name = argv[1] + 10;
+    for (i = 0; i < NUM_BACKENDS; i++) {
+        if (strcmp(name, BACKENDS[i].name) == 0) {
+            argv[1] = argv[0];
+            return BACKENDS[i].run(argc - 1, argv + 1);
+        }
+    }
+
+    fprintf(stderr, "Unknown backend '%s'\n", name);
+    usage();
+    return 1;
+}
@@ -6,279 +6,497 @@
 #include <sys/time.h>
 #include <math.h>
 
-#define CREATOR "AlexBudau"
-#define RGB_COMPONENT_COLOR 255
+#include "dither.h"
+#include "palette.h"
+#include "palette_mpi.h"
+#include "ppm.h"
+#include "backends.h"
+#include "ppm_mpi.h"
+#include "bench.h"
+#include "prof.h"
+
 #define MAX_FILE_NAME_SIZE 60
 #define OUTPUT_FILE "outmpi.ppm"
+#define DEFAULT_BLOCK_WIDTH 64
+#define DEFAULT_CHUNKS 8
 
-#define plus_truncate_uchar(a, b) \
-    if (((int)(a)) + (b) < 0) \
-        (a) = 0; \
-    else if (((int)(a)) + (b) > 255) \
-        (a) = 255; \
-    else \
-        (a) += (b);
-
-#define compute_disperse(channel, ch) \
-    error = ((int)(channel)) - palette.table[index].ch;\
-    plus_truncate_uchar(channel, (error*7) >> 4);\
-    plus_truncate_uchar(channel, (error*3) >> 4);\
-    plus_truncate_uchar(channel, (error*5) >> 4);\
-    plus_truncate_uchar(channel, (error*1) >> 4);
-
-typedef struct {
-    unsigned char R, G, B;
-} RGBTriple;
-
-typedef struct {
-    int size;
-    RGBTriple* table;
-} RGBPalette;
-
-typedef struct {
-    int width, height;
-    RGBTriple* pixels;
-} RGBImage;
-
-typedef struct {
-    int width, height;
-    unsigned char* pixels;
-} PalettizedImage;
-
-
-RGBImage *readPPM(const char *filename, int proc_num) {
-
-	RGBImage *img;
-	
-    //alloc memory form image
-    img = (RGBImage *)malloc(sizeof(RGBImage));
-    if (!img) {
-         fprintf(stderr, "Unable to allocate memory\n");
-         exit(1);
-    }
+
+static void FloydSteinbergDitherMPI(RGBImage image, RGBPalette palette, int num_procs, int proc_num,
+                                    PalettizedImage *keep) {
+    
+    struct timeval t1, t2;
+    double elapsedTime;
+
+    int *counts, *displs, *result_counts, *result_displs, rank, first, rows;
+    unsigned char *proc_pixels;
+    long size;
+    PalettizedImage result;
+    unsigned char *result_pixels;
 
     if (proc_num == 0) {
         
-        char buff[16];
-        FILE *fp;
-        int c, rgb_comp_color;
-
-    	//open PPM file for reading
-    	fp = fopen(filename, "rb");
-    	if (!fp) {
-    	  fprintf(stderr, "Unable to open file '%s'\n", filename);
-    	  exit(1);
-    	}
-
-    	//read image format
-    	if (!fgets(buff, sizeof(buff), fp)) {
-    	  perror(filename);
-    	  exit(1);
-    	}
-
-        //check the image format
-        if (buff[0] != 'P' || buff[1] != '6') {
-             fprintf(stderr, "Invalid image format (must be 'P6')\n");
-             exit(1);
-        }
+        if (!BenchRunning())
+            printf("MPI ");
+        // start timer
+        gettimeofday(&t1, NULL); 
+        result.width = image.width;
+        result.height = image.height;
+        result.pixels = getenv("DITHER_MPIIO") ? NULL :
+            (unsigned char*)malloc(sizeof(unsigned char) * result.width * result.height);
+    }
 
-        //check for comments
-        c = getc(fp);
-        while (c == '#') {
-        while (getc(fp) != '\n') ;
-             c = getc(fp);
-        }
+    // whole-row bands covering every pixel, in pixels for the result and in
+    // bytes for the RGB input
+    counts = (int*)malloc(4 * num_procs * sizeof(int));
+    displs = counts + num_procs;
+    result_counts = displs + num_procs;
+    result_displs = result_counts + num_procs;
+    for (rank = 0; rank < num_procs; rank++) {
+        WeightedBandRows(image.height, num_procs, rank, &first, &rows);
+        result_counts[rank] = rows * image.width;
+        result_displs[rank] = first * image.width;
+        counts[rank] = result_counts[rank] * 3;
+        displs[rank] = result_displs[rank] * 3;
+    }
+    WeightedBandRows(image.height, num_procs, proc_num, &first, &rows);
 
-        ungetc(c, fp);
-        //read image size information
-        if (fscanf(fp, "%d %d", &img->width, &img->height) != 2) {
-             fprintf(stderr, "Invalid image size (error loading '%s')\n", filename);
-             exit(1);
-        }
+    size = (long)rows * image.width;
+    proc_pixels = (unsigned char*)malloc(sizeof(unsigned char) * size * 3 + 1);
+    result_pixels = (unsigned char*)malloc(sizeof(unsigned char) * size + 1);
+    
+    scatterPPM(image.pixels, counts, displs, proc_pixels, proc_num);
 
-        //read rgb component
-        if (fscanf(fp, "%d", &rgb_comp_color) != 1) {
-             fprintf(stderr, "Invalid rgb component (error loading '%s')\n", filename);
-             exit(1);
-        }
+    DitherNearest((RGBTriple*)proc_pixels, size, palette, result_pixels);
 
-        //check rgb component depth
-        if (rgb_comp_color != RGB_COMPONENT_COLOR) {
-             fprintf(stderr, "'%s' does not have 8-bits components\n", filename);
-             exit(1);
-        }
+    if (getenv("DITHER_MPIIO")) {
+        writePalAll(OUTPUT_FILE, palette, image.width, image.height, result_pixels, first, rows, proc_num);
+    } else {
+        BenchBegin("communicate");
+        MPI_Gatherv(result_pixels, result_counts[proc_num], MPI_UNSIGNED_CHAR,
+            result.pixels, result_counts, result_displs, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        BenchEnd();
+    }
+
+    free(proc_pixels);
+    free(result_pixels);
+    free(counts);
 
-        while (fgetc(fp) != '\n') ;
-        //memory allocation for pixel data
-        img->pixels = (RGBTriple*)malloc(img->width * img->height * sizeof(RGBTriple));
+    if (proc_num == 0) {
+        // stop timer
+        gettimeofday(&t2, NULL);
 
-        if (!img->pixels) {
-             fprintf(stderr, "Unable to allocate memory\n");
-             exit(1);
-        }
+        // compute and print the elapsed time in millisec
+        elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
+        elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
+        if (!BenchRunning())
+            printf ("TIME = %lf\n", elapsedTime);
 
-        //read pixel data from file
-        
-        if ((fread(img->pixels, 3 * img->width, img->height , fp))!= img->height) {
-             fprintf(stderr, "Unable to load file\n");
-             exit(1);
+        if (!getenv("DITHER_MPIIO")) {
+            BenchBegin("write");
+            writePalFile(OUTPUT_FILE, palette, result);
+            BenchEnd();
         }
-
-        fclose(fp);
+        if (keep)
+            *keep = result;
+        else
+            free(result.pixels);
     }
-
-    return img;
 }
 
-void writePPM(const char *filename, RGBImage *img) {
-    FILE *fp;
-    //open file for output
-    fp = fopen(filename, "wb");
-    if (!fp) {
-         fprintf(stderr, "Unable to open file '%s'\n", filename);
-         exit(1);
-    }
+// Every rank's band is cut into `chunks` sub-bands of whole rows. All the
+// MPI_Iscatterv calls (MPI_File_iread_at_all with DITHER_MPIIO) are posted up
+// front, and each sub-band goes back with MPI_Igatherv as soon as it is done,
+// so sub-band k+1 is still arriving and k-1 still leaving while k is computed.
+// Afterwards the same data is moved once more with blocking Scatterv/Gatherv,
+// or read once more, outside the timing, to measure how much communication
+// the overlap hid. With DITHER_MPIIO the result is written once, collectively.
+static void FloydSteinbergDitherMPIOverlap(RGBImage image, RGBPalette palette, int num_procs,
+                                           int proc_num, int chunks, PalettizedImage *keep) {
+    struct timeval t1, t2;
+    double elapsedTime, computeTime = 0, waitTime = 0, blockingTime, now;
 
-    //write the header file
+    PalettizedImage result;
+    unsigned char *band, *band_result;
+    int *counts, *displs, *result_counts, *result_displs;
+    MPI_Request *scatter_req, *gather_req;
+    int i, k, first, rows, chunk_first, chunk_rows;
+    int mpiio = getenv("DITHER_MPIIO") != NULL;
 
-    //image format
-    fprintf(fp, "P6\n");
+    if (chunks < 1)
+        chunks = 1;
 
-    //comments
-    fprintf(fp, "# Created by %s\n",CREATOR);
+    if (proc_num == 0) {
+        if (!BenchRunning())
+            printf("MPI_Overlap ");
+        // start timer
+        gettimeofday(&t1, NULL);
+        result.width = image.width;
+        result.height = image.height;
+        result.pixels = mpiio ? NULL :
+            (unsigned char*)malloc(sizeof(unsigned char) * result.width * result.height);
+    }
 
-    //image size
-    fprintf(fp, "%d %d\n",img->width,img->height);
+    // counts[k][rank] for sub-band k, in bytes for the input and in pixels for
+    // the result, followed by the whole-band layout
+    counts = (int*)malloc(4 * (chunks + 1) * num_procs * sizeof(int));
+    displs = counts + (chunks + 1) * num_procs;
+    result_counts = displs + (chunks + 1) * num_procs;
+    result_displs = result_counts + (chunks + 1) * num_procs;
+    for (i = 0; i < num_procs; i++) {
+        WeightedBandRows(image.height, num_procs, i, &first, &rows);
+        for (k = 0; k <= chunks; k++) {
+            int n = k * num_procs + i;
+
+            if (k < chunks) {
+                BandRows(rows, chunks, k, &chunk_first, &chunk_rows);
+            } else {
+                chunk_first = 0;
+                chunk_rows = rows;
+            }
+            result_counts[n] = chunk_rows * image.width;
+            result_displs[n] = (first + chunk_first) * image.width;
+            counts[n] = result_counts[n] * 3;
+            displs[n] = result_displs[n] * 3;
+        }
+    }
+    WeightedBandRows(image.height, num_procs, proc_num, &first, &rows);
 
-    // rgb component depth
-    fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
+    band = (unsigned char*)malloc(sizeof(unsigned char) * rows * image.width * 3 + 1);
+    band_result = (unsigned char*)malloc(sizeof(unsigned char) * rows * image.width + 1);
+    scatter_req = (MPI_Request*)malloc(2 * chunks * sizeof(MPI_Request));
+    gather_req = scatter_req + chunks;
 
-    // pixel data
-    fwrite(img->pixels, 3 * img->width, img->height, fp);
-    fclose(fp);
-}
+    // the sub-band displacements are absolute, so they are rebased on the
+    // rank's own band on the receiving side
+    for (k = 0; k < chunks; k++) {
+        int n = k * num_procs + proc_num;
+        unsigned char *into = band + (displs[n] - displs[chunks * num_procs + proc_num]);
 
-void writePal(const char *filename, RGBPalette palette, PalettizedImage result, RGBImage image) {
-    FILE *fp;
-    //open file for output
-    fp = fopen(filename, "wb");
-    if (!fp) {
-         fprintf(stderr, "Unable to open file '%s'\n", filename);
-         exit(1);
+        iscatterPPM(image.pixels, counts + k * num_procs, displs + k * num_procs, into, proc_num,
+                    &scatter_req[k]);
     }
 
-    //write the header file
-    //image format
-    fprintf(fp, "P6\n");
+    for (k = 0; k < chunks; k++) {
+        int n = k * num_procs + proc_num;
+        long offset = result_displs[n] - result_displs[chunks * num_procs + proc_num];
+
+        now = MPI_Wtime();
+        BenchBegin(mpiio ? "read" : "communicate");
+        MPI_Wait(&scatter_req[k], MPI_STATUS_IGNORE);
+        BenchEnd();
+        waitTime += MPI_Wtime() - now;
+
+        now = MPI_Wtime();
+        DitherNearest((RGBTriple*)band + offset, result_counts[n], palette, band_result + offset);
+        computeTime += MPI_Wtime() - now;
+
+        if (mpiio)
+            gather_req[k] = MPI_REQUEST_NULL;
+        else
+            MPI_Igatherv(band_result + offset, result_counts[n], MPI_UNSIGNED_CHAR,
+                         result.pixels, result_counts + k * num_procs, result_displs + k * num_procs,
+                         MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD, &gather_req[k]);
+    }
 
-    //comments
-    fprintf(fp, "# Created by %s\n",CREATOR);
+    now = MPI_Wtime();
+    BenchBegin("communicate");
+    MPI_Waitall(chunks, gather_req, MPI_STATUSES_IGNORE);
+    BenchEnd();
+    waitTime += MPI_Wtime() - now;
+    if (mpiio)
+        writePalAll(OUTPUT_FILE, palette, image.width, image.height, band_result, first, rows, proc_num);
 
-    //image size
-    fprintf(fp, "%d %d\n",result.width,result.height);
+    if (proc_num == 0) {
+        // stop timer
+        gettimeofday(&t2, NULL);
 
-    // rgb component depth
-    fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
+        // compute and print the elapsed time in millisec
+        elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
+        elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
+        if (!BenchRunning())
+            printf ("TIME = %lf\n", elapsedTime);
+    }
+
+    // the same transfers without overlap, as a reference (a phase of its own
+    // in benchmark mode)
+    BenchBegin("reference");
+    MPI_Barrier(MPI_COMM_WORLD);
+    now = MPI_Wtime();
+    if (mpiio) {
+        scatterPPM(NULL, counts + chunks * num_procs, displs + chunks * num_procs, band, proc_num);
+    } else {
+        MPI_Scatterv(image.pixels, counts + chunks * num_procs, displs + chunks * num_procs,
+                     MPI_UNSIGNED_CHAR, band, counts[chunks * num_procs + proc_num], MPI_UNSIGNED_CHAR,
+                     0, MPI_COMM_WORLD);
+        MPI_Gatherv(band_result, result_counts[chunks * num_procs + proc_num], MPI_UNSIGNED_CHAR,
+                    result.pixels, result_counts + chunks * num_procs, result_displs + chunks * num_procs,
+                    MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    }
+    blockingTime = MPI_Wtime() - now;
+    BenchEnd();
+
+    // stderr, so run.sh still only sees the TIME line
+    if (!BenchRunning())
+        fprintf(stderr, "rank %d chunks = %d compute = %lf exposed comm = %lf blocking comm = %lf hidden = %lf\n",
+                proc_num, chunks, computeTime * 1000.0, waitTime * 1000.0, blockingTime * 1000.0,
+                blockingTime > waitTime ? (blockingTime - waitTime) * 1000.0 : 0.0);
 
+    free(scatter_req);
+    free(band);
+    free(band_result);
+    free(counts);
 
-    int x, y;
-    for(y = 0; y < result.height; y++) {
-        for(x = 0; x < result.width; x++) {
-            fwrite(&palette.table[result.pixels[x + y*image.width]],
-                   3, 1, fp);
+    if (proc_num == 0) {
+        if (!mpiio) {
+            BenchBegin("write");
+            writePalFile(OUTPUT_FILE, palette, result);
+            BenchEnd();
         }
+        if (keep)
+            *keep = result;
+        else
+            free(result.pixels);
     }
-
-    fclose(fp);
 }
 
-
-void FloydSteinbergDitherMPI(RGBImage image, RGBPalette palette, int num_procs, int proc_num) {
-    
+// True error diffusion over horizontal bands. A band's last rows push their
+// error into the first kernel rows - 1 rows of the next band (its halo), so
+// every rank keeps a copy of its successor's halo, taken before any error
+// reaches it, and sends it on one column block at a time (tag = block index)
+// as soon as its own last row is far enough past the block. The successor
+// overwrites its first rows with those pixels before touching them: they have
+// all of the previous band's error and none of their own, as in the serial
+// pass. Every rank walks its band in diagonal order, with row i working on
+// block step - i * blockLag, so its last row, and with it the next rank, gets
+// going long before the whole band is done. In serpentine order a row needs
+// the whole row above, so a block is a whole row: the halo goes out once the
+// last row is done, and the bands run one after another.
+static void FloydSteinbergDitherMPIPipeline(RGBImage image, RGBPalette palette, const DitherKernel *kernel,
+                                            int serpentine, int num_procs, int proc_num, int blockWidth,
+                                            PalettizedImage *keep) {
     struct timeval t1, t2;
-    double elapsedTime;
+    double elapsedTime, start, now, fillTime = 0, waitTime = 0;
 
-    unsigned char *pixels;
-    unsigned char *proc_pixels;
-    long size, k;
     PalettizedImage result;
-    unsigned char *result_pixels;
-    int distanceSquared, minDistanceSquared, Rdiff, Gdiff, Bdiff, error;
-    unsigned char index, R, G, B, i;
+    RGBTriple *band, *halo_in = NULL, *halo_out = NULL;
+    unsigned char *band_result;
+    int *counts, *displs, *result_counts, *result_displs;
+    MPI_Request *recv_req = NULL, *send_req = NULL;
+    int i, j, first, rows, prev, next, has_prev, has_next, halo, left, right;
+    int numBlocks, blockLag, steps, step, block, x0, x1, bx0, bx1;
+    int received = 0, sent = 0, needed, width = image.width;
 
     if (proc_num == 0) {
-        
-        printf("MPI ");
+        if (!BenchRunning())
+            printf("MPI_Pipeline ");
         // start timer
-        gettimeofday(&t1, NULL); 
+        gettimeofday(&t1, NULL);
         result.width = image.width;
         result.height = image.height;
-        result.pixels = (unsigned char*)malloc(sizeof(unsigned char) * result.width * result.height);
-        
-        pixels = (unsigned char*)malloc(sizeof(unsigned char) * image.width * image.height * 3);
-        memcpy(pixels, image.pixels, sizeof(unsigned char) * image.width * image.height * 3);
+        // with MPI-IO every rank writes its own band, so nothing is gathered
+        result.pixels = getenv("DITHER_MPIIO") ? NULL :
+            (unsigned char*)malloc(sizeof(unsigned char) * result.width * result.height);
     }
 
-    size = image.width * image.height / num_procs;
-    proc_pixels = (unsigned char*)malloc(sizeof(unsigned char) * size * 3);
-    result_pixels = (unsigned char*)malloc(sizeof(unsigned char) * size);
-    
-    MPI_Scatter(pixels, size * 3, MPI_UNSIGNED_CHAR, proc_pixels, size * 3, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
-
-    for (k = 0; k < size; k++) {
-        R = proc_pixels[k*3+0];
-        G = proc_pixels[k*3+1];
-        B = proc_pixels[k*3+2];
-
-        // FindNearestColor
-
-        minDistanceSquared = 255*255 + 255*255 + 255*255 + 1;
-        for (i = 0; i < palette.size; i++) {
-            Rdiff = ((int)R) - palette.table[i].R;
-            Gdiff = ((int)G) - palette.table[i].G;
-            Bdiff = ((int)B) - palette.table[i].B;
-            distanceSquared = Rdiff*Rdiff + Gdiff*Gdiff + Bdiff*Bdiff;
-            if (distanceSquared < minDistanceSquared) {
-                minDistanceSquared = distanceSquared;
-                index = i;
-            }
+    counts = (int*)malloc(4 * num_procs * sizeof(int));
+    displs = counts + num_procs;
+    result_counts = displs + num_procs;
+    result_displs = result_counts + num_procs;
+    // a band has to cover the halo it passes on, so with too many ranks for
+    // the rows the last ones get none
+    halo = kernel->rows - 1;
+    for (i = 0; i < num_procs; i++) {
+        MinBandRows(image.height, num_procs, i, halo, &first, &rows);
+        result_counts[i] = rows * image.width;
+        result_displs[i] = first * image.width;
+        counts[i] = result_counts[i] * 3;
+        displs[i] = result_displs[i] * 3;
+    }
+    MinBandRows(image.height, num_procs, proc_num, halo, &first, &rows);
+    // ranks left without rows (fewer rows than ranks, or a tiny weight) sit
+    // out, and the halo skips over them
+    for (prev = proc_num - 1; prev >= 0 && result_counts[prev] == 0; prev--) ;
+    for (next = proc_num + 1; next < num_procs && result_counts[next] == 0; next++) ;
+    has_prev = rows > 0 && prev >= 0;
+    has_next = rows > 0 && next < num_procs;
+
+    // how far the taps reach left in the rows below, and right in any row
+    left = right = 0;
+    for (i = 0; i < kernel->numTaps; i++) {
+        if (kernel->taps[i].dy > 0 && -kernel->taps[i].dx > left)
+            left = -kernel->taps[i].dx;
+        if (kernel->taps[i].dx > right)
+            right = kernel->taps[i].dx;
+    }
+
+    band = (RGBTriple*)malloc(sizeof(RGBTriple) * (rows + halo) * image.width + 1);
+    band_result = (unsigned char*)malloc(sizeof(unsigned char) * rows * image.width + 1);
+
+    scatterPPM(image.pixels, counts, displs, band, proc_num);
+
+    if (blockWidth < 2)
+        blockWidth = 2;
+    if (serpentine)
+        blockWidth = image.width;
+    numBlocks = (image.width + blockWidth - 1) / blockWidth;
+    blockLag = serpentine ? 1 : 2 + (KernelLag(kernel) - 2) / blockWidth;
+    steps = rows > 0 ? numBlocks + blockLag * (rows - 1) : 0;
+
+    // the successor's first rows as they are before any error
+    BenchBegin("communicate");
+    MPI_Sendrecv(band, has_prev ? 3 * halo * width : 0, MPI_UNSIGNED_CHAR,
+                 has_prev ? prev : MPI_PROC_NULL, numBlocks,
+                 band + (long)rows * width, has_next ? 3 * halo * width : 0, MPI_UNSIGNED_CHAR,
+                 has_next ? next : MPI_PROC_NULL, numBlocks, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    BenchEnd();
+    start = MPI_Wtime();
+
+    // halo blocks travel packed: block b holds its columns of every halo row
+    if (has_prev) {
+        halo_in = (RGBTriple*)malloc(halo * width * sizeof(RGBTriple));
+        recv_req = (MPI_Request*)malloc(numBlocks * sizeof(MPI_Request));
+        for (block = 0; block < numBlocks; block++) {
+            x0 = block * blockWidth;
+            x1 = x0 + blockWidth < width ? x0 + blockWidth : width;
+            MPI_Irecv(halo_in + (long)halo * x0, 3 * halo * (x1 - x0), MPI_UNSIGNED_CHAR, prev, block,
+                      MPI_COMM_WORLD, &recv_req[block]);
         }
+    }
+    if (has_next) {
+        halo_out = (RGBTriple*)malloc(halo * width * sizeof(RGBTriple));
+        send_req = (MPI_Request*)malloc(numBlocks * sizeof(MPI_Request));
+    }
 
-        {
-        compute_disperse(proc_pixels[k*3+0], R);    
-        compute_disperse(proc_pixels[k*3+1], G);
-        compute_disperse(proc_pixels[k*3+2], B);
+    for (step = 0; step < steps; step++) {
+        for (i = 0; i < rows; i++) {
+            RGBTriple *row = band + (long)i * width;
+            unsigned char *row_result = band_result + (long)i * width;
+
+            block = step - i * blockLag;
+            if (block < 0)
+                break;
+            if (block >= numBlocks)
+                continue;
+            x0 = block * blockWidth;
+            x1 = x0 + blockWidth < width ? x0 + blockWidth : width;
+
+            // the span touches rows i and below up to x1 - 1 + right, and the
+            // halo part of them has to be in from the previous rank first
+            if (i < halo && has_prev) {
+                needed = x1 + right < width ? x1 + right : width;
+                while (received < numBlocks && received * blockWidth < needed) {
+                    now = MPI_Wtime();
+                    BenchBegin("communicate");
+                    MPI_Wait(&recv_req[received], MPI_STATUS_IGNORE);
+                    BenchEnd();
+                    waitTime += MPI_Wtime() - now;
+                    if (received == 0)
+                        fillTime = MPI_Wtime() - start;
+                    bx0 = received * blockWidth;
+                    bx1 = bx0 + blockWidth < width ? bx0 + blockWidth : width;
+                    for (j = 0; j < halo; j++)
+                        memcpy(band + (long)j * width + bx0, halo_in + (long)halo * bx0 + (long)j * (bx1 - bx0),
+                               (bx1 - bx0) * sizeof(RGBTriple));
+                    received++;
+                }
+            }
+
+            DitherSpan(kernel, row, width, (has_next ? rows + halo : rows) - 1 - i, x0, x1,
+                       serpentine && ((first + i) & 1), palette, row_result);
+
+            // a halo column is final once the last row is `left` columns past it
+            while (i == rows - 1 && has_next && sent < numBlocks) {
+                bx0 = sent * blockWidth;
+                bx1 = bx0 + blockWidth < width ? bx0 + blockWidth : width;
+                if (x1 < width && bx1 + left > x1)
+                    break;
+                for (j = 0; j < halo; j++)
+                    memcpy(halo_out + (long)halo * bx0 + (long)j * (bx1 - bx0), band + (long)(rows + j) * width + bx0,
+                           (bx1 - bx0) * sizeof(RGBTriple));
+                MPI_Isend(halo_out + (long)halo * bx0, 3 * halo * (bx1 - bx0), MPI_UNSIGNED_CHAR, next, sent,
+                          MPI_COMM_WORLD, &send_req[sent]);
+                sent++;
+            }
         }
-        result_pixels[k] = index;
     }
 
-    free(proc_pixels);
-    free(result_pixels);
+    if (has_next) {
+        BenchBegin("communicate");
+        MPI_Waitall(numBlocks, send_req, MPI_STATUSES_IGNORE);
+        BenchEnd();
+    }
 
-    MPI_Gather(result_pixels, size, MPI_UNSIGNED_CHAR,
-        result.pixels, size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    // stderr, so run.sh still only sees the TIME line
+    if (!BenchRunning())
+        fprintf(stderr, "rank %d fill = %lf wait = %lf\n", proc_num, fillTime * 1000.0, waitTime * 1000.0);
+
+    if (getenv("DITHER_MPIIO")) {
+        writePalAll(OUTPUT_FILE, palette, image.width, image.height, band_result, first, rows, proc_num);
+    } else {
+        BenchBegin("communicate");
+        MPI_Gatherv(band_result, result_counts[proc_num], MPI_UNSIGNED_CHAR,
+            result.pixels, result_counts, result_displs, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        BenchEnd();
+    }
+
+    free(halo_in);
+    free(halo_out);
+    free(recv_req);
+    free(send_req);
+    free(band);
+    free(band_result);
+    free(counts);
 
     if (proc_num == 0) {
-        free(pixels);
         // stop timer
         gettimeofday(&t2, NULL);
 
         // compute and print the elapsed time in millisec
         elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
         elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
-        printf ("TIME = %lf\n", elapsedTime); 
+        if (!BenchRunning())
+            printf ("TIME = %lf\n", elapsedTime);
 
-        writePal(OUTPUT_FILE, palette, result, image);
+        if (!getenv("DITHER_MPIIO")) {
+            BenchBegin("write");
+            writePalFile(OUTPUT_FILE, palette, result);
+            BenchEnd();
+        }
+        if (keep)
+            *keep = result;
+        else
+            free(result.pixels);
     }
 }
 
 
-int main(int argc, char* argv[]){
+// the engine picked on the command line; it writes the output itself, and
+// hands the result back on rank 0 through `keep` instead of freeing it when
+// keep is not NULL
+static void DitherMode(int argc, char* argv[], RGBImage image, RGBPalette palette,
+                       const DitherKernel *kernel, int serpentine, int num_procs, int proc_num,
+                       PalettizedImage *keep) {
+    if (argc > 2 && strcmp(argv[2], "pipeline") == 0)
+        FloydSteinbergDitherMPIPipeline(image, palette, kernel, serpentine, num_procs, proc_num,
+                                        argc > 3 ? atoi(argv[3]) : DEFAULT_BLOCK_WIDTH, keep);
+    else if (argc > 2 && strcmp(argv[2], "overlap") == 0)
+        FloydSteinbergDitherMPIOverlap(image, palette, num_procs, proc_num,
+                                       argc > 3 ? atoi(argv[3]) : DEFAULT_CHUNKS, keep);
+    else
+        FloydSteinbergDitherMPI(image, palette, num_procs, proc_num, keep);
+}
+
+int RunMPI(int argc, char* argv[]){
+    int check = CheckArgument(&argc, argv), status = 0;
 
-    if (argc != 2) {
-        printf("call <floyd> input\n");
+    if (argc < 2 || argc > 4) {
+        printf("call <floyd> input [pipeline [block_width] | overlap [chunks]] [check]\n");
         exit(1);
     }
+    if (check && getenv("DITHER_MPIIO")) {
+         fprintf(stderr, "check needs the whole image on rank 0, it does not work with DITHER_MPIIO\n");
+         exit(1);
+    }
 
     MPI_Init(NULL, NULL);
 
@@ -291,74 +509,74 @@ int main(int argc, char* argv[]){
 
     RGBImage *image;
     RGBPalette palette;
+    PalettizedImage result;
+    const DitherKernel *kernel;
+    int serpentine = SerpentineScan();
+    int pipeline = argc > 2 && strcmp(argv[2], "pipeline") == 0;
+    struct timeval t1;
+    const char *mode = pipeline ? "MPI_Pipeline" :
+                       argc > 2 && strcmp(argv[2], "overlap") == 0 ? "MPI_Overlap" : "MPI";
 
-    palette.size = 16;
-    palette.table = (RGBTriple*)malloc(sizeof(RGBTriple) * 16);
-    palette.table[0].R = 149;
-    palette.table[0].G = 91;
-    palette.table[0].B = 110;
-    palette.table[1].R = 176;
-    palette.table[1].G = 116;
-    palette.table[1].B = 137;
-    palette.table[2].R = 17;
-    palette.table[2].G = 11;
-    palette.table[2].B = 15;
-    palette.table[3].R = 63;
-    palette.table[3].G = 47;
-    palette.table[3].B = 69;
-    palette.table[4].R = 93;
-    palette.table[4].G = 75;
-    palette.table[4].B = 112;
-    palette.table[5].R = 47;
-    palette.table[5].G = 62;
-    palette.table[5].B = 24;
-    palette.table[6].R = 76;
-    palette.table[6].G = 90;
-    palette.table[6].B = 55;
-    palette.table[7].R = 190;
-    palette.table[7].G = 212;
-    palette.table[7].B = 115;
-    palette.table[8].R = 160;
-    palette.table[8].G = 176;
-    palette.table[8].B = 87;
-    palette.table[9].R = 116;
-    palette.table[9].G = 120;
-    palette.table[9].B = 87;
-    palette.table[10].R = 245;
-    palette.table[10].G = 246;
-    palette.table[10].B = 225;
-    palette.table[11].R = 148;
-    palette.table[11].G = 146;
-    palette.table[11].B = 130;
-    palette.table[12].R = 200;
-    palette.table[12].G = 195;
-    palette.table[12].B = 180;
-    palette.table[13].R = 36;
-    palette.table[13].G = 32;
-    palette.table[13].B = 27;
-    palette.table[14].R = 87;
-    palette.table[14].G = 54;
-    palette.table[14].B = 45;
-    palette.table[15].R = 121;
-    palette.table[15].G = 72;
-    palette.table[15].B = 72;
+    palette = loadPalette();
+    kernel = loadKernel();
+    ProfStart();
 
     
     strcpy(input, argv[1]);
     
-    image = readPPM(input, world_rank);
+    gettimeofday(&t1, NULL);
+    if (getenv("DITHER_MPIIO"))
+        image = openPPMAll(input, world_rank);
+    else if (world_rank == 0 && getenv("DITHER_MMAP"))
+        image = mapPPM(input);
+    else
+        image = readPPMRoot(input, world_rank);
+    if (world_rank == 0)
+        reportLoad(&t1);
 
     MPI_Bcast(&image->width, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&image->height, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    SetupPaletteMPI(&palette, *image, world_size, world_rank, 1, RunWorkersSerial);
      
-    FloydSteinbergDitherMPI(*image, palette, world_size, world_rank);
-    
-    if (world_rank == 0) {
-        free(image->pixels);
+    DitherMode(argc, argv, *image, palette, kernel, serpentine, world_size, world_rank, check ? &result : NULL);
+    ProfReport(mode, world_rank);
+
+    // the pipeline diffuses the error, the other modes only map every pixel
+    if (check && world_rank == 0) {
+        status = !CheckResult(result, *image, palette, pipeline ? kernel : FindKernel("nearest"),
+                              pipeline && serpentine);
+        free(result.pixels);
+    }
+
+    // DITHER_BENCH: the same read, dither and write again, with per-phase
+    // statistics from rank 0
+    if (BenchStart()) {
+        do {
+            if (world_rank == 0 && !getenv("DITHER_MPIIO"))
+                BenchReadPPM(input);
+            BenchBegin("compute");
+            DitherMode(argc, argv, *image, palette, kernel, serpentine, world_size, world_rank, NULL);
+            BenchEnd();
+        } while (BenchNext());
+        BenchReport(mode, (long)image->width * image->height, world_rank == 0);
     }
 
-    free(image);
+    closePPMAll();
+    if (world_rank == 0 && getenv("DITHER_MMAP") && !getenv("DITHER_MPIIO")) {
+        unmapPPM(image);
+    } else {
+        if (world_rank == 0)
+            free(image->pixels);
+        free(image);
+    }
 
     MPI_Finalize();
-    return 0;
+    return status;
+}
+
+#ifndef DITHER_DRIVER
+int main(int argc, char* argv[]) {
+    return RunMPI(argc, argv);
 }
+#endif
@@ -6,247 +6,183 @@
 #include <sys/time.h>
 #include <math.h>
 
-#define CREATOR "AlexBudau"
-#define RGB_COMPONENT_COLOR 255
+#include "dither.h"
+#include "palette.h"
+#include "ppm.h"
+#include "bench.h"
+#include "prof.h"
+#include "backends.h"
+
 #define MAX_FILE_NAME_SIZE 60
 #define OUTPUT_FILE "outomp.ppm"
-
-#define plus_truncate_uchar(a, b) \
-    if (((int)(a)) + (b) < 0) \
-        (a) = 0; \
-    else if (((int)(a)) + (b) > 255) \
-        (a) = 255; \
-    else \
-        (a) += (b);
-
-#define compute_disperse(channel) \
-    error = ((int)(currentPixel->channel)) - table[index].channel; \
-    plus_truncate_uchar(currentPixel->channel, (error*7) >> 4);\
-    plus_truncate_uchar(currentPixel->channel, (error*3) >> 4);\
-    plus_truncate_uchar(currentPixel->channel, (error*5) >> 4); \
-    plus_truncate_uchar(currentPixel->channel, (error*1) >> 4);
-
-typedef struct {
-    unsigned char R, G, B;
-} RGBTriple;
-
-typedef struct {
-    int size;
-    RGBTriple* table;
-} RGBPalette;
-
-typedef struct {
-    int width, height;
-    RGBTriple* pixels;
-} RGBImage;
-
-typedef struct {
-    int width, height;
-    unsigned char* pixels;
-} PalettizedImage;
-
-
-RGBImage *readPPM(const char *filename) {
-
-	char buff[16];
-	RGBImage *img;
-	FILE *fp;
-	int c, rgb_comp_color;
-
-	//open PPM file for reading
-	fp = fopen(filename, "rb");
-	if (!fp) {
-	  fprintf(stderr, "Unable to open file '%s'\n", filename);
-	  exit(1);
-	}
-
-	//read image format
-	if (!fgets(buff, sizeof(buff), fp)) {
-	  perror(filename);
-	  exit(1);
-	}
-
-    //check the image format
-    if (buff[0] != 'P' || buff[1] != '6') {
-         fprintf(stderr, "Invalid image format (must be 'P6')\n");
-         exit(1);
+#define DEFAULT_BLOCK_WIDTH 64
+#define DEFAULT_TILE_ROWS 8
+
+// DITHER_NUMA=local: a fresh copy of the image, copied in the same per-thread
+// ranges as FloydSteinbergDitherOMP so every thread first-touches its chunk;
+// the threads only stay on their node when bound (OMP_PLACES/OMP_PROC_BIND)
+static RGBImage *LocalImageOMP(const RGBImage *image) {
+    RGBImage *local = (RGBImage*)malloc(sizeof(RGBImage));
+    long size = (long)image->width * image->height;
+
+    if (local) {
+        *local = *image;
+        local->pixels = (RGBTriple*)malloc(size * sizeof(RGBTriple));
     }
-
-    //alloc memory form image
-    img = (RGBImage *)malloc(sizeof(RGBImage));
-    if (!img) {
+    if (!local || !local->pixels) {
          fprintf(stderr, "Unable to allocate memory\n");
          exit(1);
     }
+    if (omp_get_proc_bind() == omp_proc_bind_false)
+        fprintf(stderr, "DITHER_NUMA=local without OMP_PROC_BIND, try OMP_PLACES=cores OMP_PROC_BIND=close\n");
 
-    //check for comments
-    c = getc(fp);
-    while (c == '#') {
-    while (getc(fp) != '\n') ;
-         c = getc(fp);
-    }
-
-    ungetc(c, fp);
-    //read image size information
-    if (fscanf(fp, "%d %d", &img->width, &img->height) != 2) {
-         fprintf(stderr, "Invalid image size (error loading '%s')\n", filename);
-         exit(1);
-    }
+    #pragma omp parallel
+    {
+        long first = size * omp_get_thread_num() / omp_get_num_threads();
+        long last = size * (omp_get_thread_num() + 1) / omp_get_num_threads();
 
-    //read rgb component
-    if (fscanf(fp, "%d", &rgb_comp_color) != 1) {
-         fprintf(stderr, "Invalid rgb component (error loading '%s')\n", filename);
-         exit(1);
+        memcpy(local->pixels + first, image->pixels + first, (last - first) * sizeof(RGBTriple));
     }
 
-    //check rgb component depth
-    if (rgb_comp_color != RGB_COMPONENT_COLOR) {
-         fprintf(stderr, "'%s' does not have 8-bits components\n", filename);
-         exit(1);
-    }
+    return local;
+}
 
-    while (fgetc(fp) != '\n') ;
-    //memory allocation for pixel data
-    img->pixels = (RGBTriple*)malloc(img->width * img->height * sizeof(RGBTriple));
+static PalettizedImage FloydSteinbergDitherOMP(RGBImage image, RGBPalette palette) {
+    PalettizedImage result;
+    long size = (long)image.width * image.height;
 
-    if (!img->pixels) {
+    result.width = image.width;
+    result.height = image.height;
+    result.pixels = (unsigned char*)malloc(sizeof(unsigned char) * size);
+    if (!result.pixels) {
          fprintf(stderr, "Unable to allocate memory\n");
          exit(1);
     }
 
-    //read pixel data from file
-    
-    if ((fread(img->pixels, 3 * img->width, img->height , fp))!= img->height) {
-         fprintf(stderr, "Unable to load file\n");
-         exit(1);
-    }
+    #pragma omp parallel
+    {
+        // one contiguous chunk per thread, as LocalImageOMP copied them
+        long first = size * omp_get_thread_num() / omp_get_num_threads();
+        long last = size * (omp_get_thread_num() + 1) / omp_get_num_threads();
 
-    fclose(fp);
-    return img;
-}
+        DitherNearest(image.pixels + first, last - first, palette, result.pixels + first);
 
-void writePPM(const char *filename, RGBImage *img) {
-    FILE *fp;
-    //open file for output
-    fp = fopen(filename, "wb");
-    if (!fp) {
-         fprintf(stderr, "Unable to open file '%s'\n", filename);
-         exit(1);
+        // the barrier the parallel region ends with, timed on its own
+        ProfBegin(PROF_WAIT);
+        #pragma omp barrier
+        ProfEnd(PROF_WAIT);
     }
-
-    //write the header file
-
-    //image format
-    fprintf(fp, "P6\n");
-
-    //comments
-    fprintf(fp, "# Created by %s\n",CREATOR);
-
-    //image size
-    fprintf(fp, "%d %d\n",img->width,img->height);
-
-    // rgb component depth
-    fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
-
-    // pixel data
-    fwrite(img->pixels, 3 * img->width, img->height, fp);
-    fclose(fp);
+    return result;
 }
 
-PalettizedImage FloydSteinbergDitherOMP(RGBImage image, RGBPalette palette) {
+// Real error diffusion scheduled as OpenMP tasks. A tile is tileRows rows by
+// blockWidth columns, and every row of the tile is shifted the kernel's lag
+// minus one columns left of the one above it, so the rows inside a tile
+// already respect the lag. A tile only waits on its left, upper and
+// upper-right tiles through depend clauses, and never on a barrier over the
+// whole image. In serpentine order a row needs the whole row above, so the
+// tiles are bands of whole rows and each one waits for the band above.
+static PalettizedImage FloydSteinbergDitherOMPTasks(RGBImage image, RGBPalette palette,
+                                                    const DitherKernel *kernel, int serpentine,
+                                                    int blockWidth, int tileRows) {
     PalettizedImage result;
+    RGBTriple *pixels;
+    char *tiles;
+    long size;
+    int lag, skew, numGroups, numBlocks;
+
     result.width = image.width;
     result.height = image.height;
-    result.pixels = (unsigned char*)malloc(sizeof(unsigned char) * result.width * result.height);
+    size = (long)image.width * image.height;
+    result.pixels = (unsigned char*)malloc(sizeof(unsigned char) * size);
+    pixels = (RGBTriple*)malloc(size * sizeof(RGBTriple));
+    if (!result.pixels || !pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    memcpy(pixels, image.pixels, size * sizeof(RGBTriple));
+
+    lag = KernelLag(kernel);
+    skew = lag - 1;
+    if (tileRows < 1)
+        tileRows = 1;
+    // the last row of the upper tile has to reach past the next tile's first row
+    if (blockWidth < (tileRows - 1) * skew + lag - 1)
+        blockWidth = (tileRows - 1) * skew + lag - 1;
+    if (serpentine) {
+        skew = 0;
+        blockWidth = image.width;
+    }
+    numGroups = (image.height + tileRows - 1) / tileRows;
+    numBlocks = (image.width + (tileRows - 1) * skew + blockWidth - 1) / blockWidth;
 
-    RGBTriple *currentPixel;
-    int paletteSize = palette.size;
+    // one dependency token per tile, with an extra row above and a column on
+    // each side so border tiles can name neighbours that never run
+    tiles = (char*)calloc((long)(numGroups + 1) * (numBlocks + 2), sizeof(char));
+    if (!tiles) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    #define tile(t, b) tiles[(long)((t) + 1) * (numBlocks + 2) + (b) + 1]
 
+    // a thread that is not running a tile is waiting for one; the tiles mark
+    // their own kernel time inside DitherSpan
     #pragma omp parallel
     {
-        RGBTriple *start = image.pixels;
-        RGBTriple *end = image.pixels + image.height*image.width;
-        unsigned char *resultPixels = result.pixels;
-        int Rdiff, Gdiff, Bdiff, distanceSquared, minDistanceSquared, error;
-        RGBTriple color;
-        unsigned char index, i;
-
-        RGBTriple* table = (RGBTriple*)malloc(sizeof(RGBTriple) * 16);
-        memcpy(table, palette.table, sizeof(RGBTriple) * 16);
-
-        //printf("num threads : %d\n", omp_get_num_threads());
-        long chunk = image.height*image.width / omp_get_num_threads();
-
-        #pragma omp for schedule(static, chunk) firstprivate(paletteSize)
-        for (currentPixel = start; currentPixel < end; currentPixel++) {
-      
-            color = *currentPixel;
-
-            // FindNearestColor
-
-            minDistanceSquared = 255*255 + 255*255 + 255*255 + 1;
-            for (i = 0; i< paletteSize; i++) {
-                Rdiff = ((int)color.R) - table[i].R;
-                Gdiff = ((int)color.G) - table[i].G;
-                Bdiff = ((int)color.B) - table[i].B;
-                distanceSquared = Rdiff*Rdiff + Gdiff*Gdiff + Bdiff*Bdiff;
-                if (distanceSquared < minDistanceSquared) {
-                    minDistanceSquared = distanceSquared;
-                    index = i;
+        ProfBegin(PROF_WAIT);
+        #pragma omp single
+        {
+            int t, b;
+
+            for (t = 0; t < numGroups; t++) {
+                for (b = 0; b < numBlocks; b++) {
+                    #pragma omp task firstprivate(t, b) \
+                        depend(in: tile(t, b - 1), tile(t - 1, b), tile(t - 1, b + 1)) \
+                        depend(out: tile(t, b))
+                    {
+                        int i, y, x0, x1;
+
+                        for (i = 0; i < tileRows; i++) {
+                            y = t * tileRows + i;
+                            if (y >= image.height)
+                                break;
+                            x0 = b * blockWidth - i * skew;
+                            x1 = x0 + blockWidth;
+                            if (x0 < 0)
+                                x0 = 0;
+                            if (x1 > image.width)
+                                x1 = image.width;
+                            if (x0 >= x1)
+                                continue;
+                            DitherSpan(kernel, pixels + (long)y * image.width, image.width,
+                                       image.height - 1 - y, x0, x1, serpentine && (y & 1), palette,
+                                       result.pixels + (long)y * image.width);
+                        }
+                    }
                 }
             }
-            {
-            compute_disperse(R);
-            compute_disperse(G);
-            compute_disperse(B);
-            }
-            *(resultPixels + (currentPixel - start)) = index;
-        }
-    }
-    return result;
-}
-
-void writePal(const char *filename, RGBPalette palette, PalettizedImage result, RGBImage image) {
-    FILE *fp;
-    //open file for output
-    fp = fopen(filename, "wb");
-    if (!fp) {
-         fprintf(stderr, "Unable to open file '%s'\n", filename);
-         exit(1);
-    }
-
-    //write the header file
-    //image format
-    fprintf(fp, "P6\n");
-
-    //comments
-    fprintf(fp, "# Created by %s\n",CREATOR);
-
-    //image size
-    fprintf(fp, "%d %d\n",result.width,result.height);
-
-    // rgb component depth
-    fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
-
-
-    int x, y;
-    for(y = 0; y < result.height; y++) {
-        for(x = 0; x < result.width; x++) {
-            fwrite(&palette.table[result.pixels[x + y*image.width]],
-                   3, 1, fp);
         }
+        ProfEnd(PROF_WAIT);
     }
+    #undef tile
 
-    fclose(fp);
+    free(tiles);
+    free(pixels);
+    return result;
 }
 
-int main(int argc, char* argv[]){
+int RunOMP(int argc, char* argv[]){
+    int check = CheckArgument(&argc, argv), status = 0;
 
-    if (argc != 2) {
-        printf("call <floyd> input\n");
+    if (argc < 2 || argc > 5) {
+        printf("call <floyd> input [tasks [block_width [tile_rows]]] [check]\n");
         exit(1);
     }
     
+    int tasks = argc > 2 && strcmp(argv[2], "tasks") == 0;
+    int mapped;
+    int blockWidth = argc > 3 ? atoi(argv[3]) : DEFAULT_BLOCK_WIDTH;
+    int tileRows = argc > 4 ? atoi(argv[4]) : DEFAULT_TILE_ROWS;
     char input[MAX_FILE_NAME_SIZE];
     struct timeval t1, t2;
     double elapsedTime;
@@ -254,67 +190,49 @@ int main(int argc, char* argv[]){
     RGBImage *image;
     RGBPalette palette;
     PalettizedImage result;
+    const DitherKernel *kernel = loadKernel();
+    int serpentine = SerpentineScan();
 
-    palette.size = 16;
-    palette.table = (RGBTriple*)malloc(sizeof(RGBTriple) * 16);
-    palette.table[0].R = 149;
-    palette.table[0].G = 91;
-    palette.table[0].B = 110;
-    palette.table[1].R = 176;
-    palette.table[1].G = 116;
-    palette.table[1].B = 137;
-    palette.table[2].R = 17;
-    palette.table[2].G = 11;
-    palette.table[2].B = 15;
-    palette.table[3].R = 63;
-    palette.table[3].G = 47;
-    palette.table[3].B = 69;
-    palette.table[4].R = 93;
-    palette.table[4].G = 75;
-    palette.table[4].B = 112;
-    palette.table[5].R = 47;
-    palette.table[5].G = 62;
-    palette.table[5].B = 24;
-    palette.table[6].R = 76;
-    palette.table[6].G = 90;
-    palette.table[6].B = 55;
-    palette.table[7].R = 190;
-    palette.table[7].G = 212;
-    palette.table[7].B = 115;
-    palette.table[8].R = 160;
-    palette.table[8].G = 176;
-    palette.table[8].B = 87;
-    palette.table[9].R = 116;
-    palette.table[9].G = 120;
-    palette.table[9].B = 87;
-    palette.table[10].R = 245;
-    palette.table[10].G = 246;
-    palette.table[10].B = 225;
-    palette.table[11].R = 148;
-    palette.table[11].G = 146;
-    palette.table[11].B = 130;
-    palette.table[12].R = 200;
-    palette.table[12].G = 195;
-    palette.table[12].B = 180;
-    palette.table[13].R = 36;
-    palette.table[13].G = 32;
-    palette.table[13].B = 27;
-    palette.table[14].R = 87;
-    palette.table[14].G = 54;
-    palette.table[14].B = 45;
-    palette.table[15].R = 121;
-    palette.table[15].G = 72;
-    palette.table[15].B = 72;
+    palette = loadPalette();
+    ProfStart();
 
     
     strcpy(input, argv[1]);
 
-    image = readPPM(input);
+    gettimeofday(&t1, NULL);
+    mapped = getenv("DITHER_MMAP") != NULL;
+    image = mapped ? mapPPM(input) : readPPM(input);
+    reportLoad(&t1);
+
+    // only the static schedule has a fixed owner for every pixel
+    if (NumaLocal() && !tasks) {
+        RGBImage *local;
+
+        gettimeofday(&t1, NULL);
+        local = LocalImageOMP(image);
+        if (mapped) {
+            unmapPPM(image);
+        } else {
+            free(image->pixels);
+            free(image);
+        }
+        image = local;
+        mapped = 0;
+        gettimeofday(&t2, NULL);
+        elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;
+        elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
+        fprintf(stderr, "FIRST TOUCH TIME = %lf\n", elapsedTime);
+    }
 
-    printf("OMP ");
+    SetupPalette(&palette, *image, omp_get_max_threads(), RunWorkersOMP);
+
+    printf(tasks ? "OMP_Tasks " : "OMP ");
     // start timer
     gettimeofday(&t1, NULL);    
-    result = FloydSteinbergDitherOMP(*image, palette);
+    if (tasks)
+        result = FloydSteinbergDitherOMPTasks(*image, palette, kernel, serpentine, blockWidth, tileRows);
+    else
+        result = FloydSteinbergDitherOMP(*image, palette);
     // stop timer
     gettimeofday(&t2, NULL);
 
@@ -322,10 +240,45 @@ int main(int argc, char* argv[]){
     elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
     elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
     printf ("TIME = %lf\n", elapsedTime); 
-    writePal(OUTPUT_FILE, palette, result, *image);
+    ProfReport(tasks ? "OMP_Tasks" : "OMP", -1);
+    writePal(OUTPUT_FILE, palette, result, omp_get_max_threads(), RunWorkersOMP);
+
+    // DITHER_BENCH: the same read, dither and write again, with per-phase statistics
+    if (BenchStart()) {
+        do {
+            free(result.pixels);
+            BenchReadPPM(input);
+            BenchBegin("compute");
+            if (tasks)
+                result = FloydSteinbergDitherOMPTasks(*image, palette, kernel, serpentine, blockWidth, tileRows);
+            else
+                result = FloydSteinbergDitherOMP(*image, palette);
+            BenchEnd();
+            BenchBegin("write");
+            writePal(OUTPUT_FILE, palette, result, omp_get_max_threads(), RunWorkersOMP);
+            BenchEnd();
+        } while (BenchNext());
+        BenchReport(tasks ? "OMP_Tasks" : "OMP", (long)image->width * image->height, 1);
+    }
 
-    free(image->pixels);
-    free(image);
+    // the tasks diffuse the error, the static chunks only map every pixel
+    if (check)
+        status = !CheckResult(result, *image, palette, tasks ? kernel : FindKernel("nearest"),
+                              tasks && serpentine);
+
+    free(result.pixels);
+    if (mapped) {
+        unmapPPM(image);
+    } else {
+        free(image->pixels);
+        free(image);
+    }
+
+    return status;
+}
 
-    return 0;
+#ifndef DITHER_DRIVER
+int main(int argc, char* argv[]) {
+    return RunOMP(argc, argv);
 }
+#endif
@@ -7,44 +7,18 @@
 #include <math.h>
 #include <pthread.h>
 
-#define CREATOR "AlexBudau"
-#define RGB_COMPONENT_COLOR 255
-#define MAX_FILE_NAME_SIZE 60
-#define OUTPUT_FILE "outmpithreads.ppm"
-
-#define plus_truncate_uchar(a, b) \
-    if (((int)(a)) + (b) < 0) \
-        (a) = 0; \
-    else if (((int)(a)) + (b) > 255) \
-        (a) = 255; \
-    else \
-        (a) += (b);
-
-#define compute_disperse(channel) \
-    error = ((int)(color.channel)) - p->palette.table[index].channel; \
-    plus_truncate_uchar(color.channel, (error*7) >> 4);\
-    plus_truncate_uchar(color.channel, (error*3) >> 4);\
-    plus_truncate_uchar(color.channel, (error*5) >> 4); \
-    plus_truncate_uchar(color.channel, (error*1) >> 4);
-
-typedef struct {
-    unsigned char R, G, B;
-} RGBTriple;
-
-typedef struct {
-    int size;
-    RGBTriple* table;
-} RGBPalette;
-
-typedef struct {
-    int width, height;
-    RGBTriple* pixels;
-} RGBImage;
+#include "dither.h"
+#include "palette.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "steal.h"
+#include "ppm.h"
+#include "bench.h"
+#include "prof.h"
+#include "backends.h"
 
-typedef struct {
-    int width, height;
-    unsigned char* pixels;
-} PalettizedImage;
+#define MAX_FILE_NAME_SIZE 60
+#define OUTPUT_FILE "outthreads.ppm"
 
 typedef struct {
     long size;
@@ -53,235 +27,214 @@ typedef struct {
     RGBPalette palette;
 } TParam;
 
-RGBImage *readPPM(const char *filename) {
-
-	char buff[16];
-	RGBImage *img;
-	FILE *fp;
-	int c, rgb_comp_color;
-
-	//open PPM file for reading
-	fp = fopen(filename, "rb");
-	if (!fp) {
-	  fprintf(stderr, "Unable to open file '%s'\n", filename);
-	  exit(1);
-	}
-
-	//read image format
-	if (!fgets(buff, sizeof(buff), fp)) {
-	  perror(filename);
-	  exit(1);
-	}
-
-    //check the image format
-    if (buff[0] != 'P' || buff[1] != '6') {
-         fprintf(stderr, "Invalid image format (must be 'P6')\n");
-         exit(1);
-    }
-
-    //alloc memory form image
-    img = (RGBImage *)malloc(sizeof(RGBImage));
-    if (!img) {
-         fprintf(stderr, "Unable to allocate memory\n");
-         exit(1);
-    }
-
-    //check for comments
-    c = getc(fp);
-    while (c == '#') {
-    while (getc(fp) != '\n') ;
-         c = getc(fp);
-    }
-
-    ungetc(c, fp);
-    //read image size information
-    if (fscanf(fp, "%d %d", &img->width, &img->height) != 2) {
-         fprintf(stderr, "Invalid image size (error loading '%s')\n", filename);
-         exit(1);
-    }
-
-    //read rgb component
-    if (fscanf(fp, "%d", &rgb_comp_color) != 1) {
-         fprintf(stderr, "Invalid rgb component (error loading '%s')\n", filename);
-         exit(1);
-    }
-
-    //check rgb component depth
-    if (rgb_comp_color != RGB_COMPONENT_COLOR) {
-         fprintf(stderr, "'%s' does not have 8-bits components\n", filename);
-         exit(1);
-    }
-
-    while (fgetc(fp) != '\n') ;
-    //memory allocation for pixel data
-    img->pixels = (RGBTriple*)malloc(img->width * img->height * sizeof(RGBTriple));
-
-    if (!img->pixels) {
-         fprintf(stderr, "Unable to allocate memory\n");
-         exit(1);
-    }
+// rows of src copied to dst by the worker that will dither them: one BandRows
+// band, or rows id, id + num_threads, ... when interleaved
+typedef struct {
+    int id, num_threads, interleave;
+    RGBImage src, dst;
+} TCopyParam;
 
-    //read pixel data from file
-    
-    if ((fread(img->pixels, 3 * img->width, img->height , fp))!= img->height) {
-         fprintf(stderr, "Unable to load file\n");
-         exit(1);
-    }
+static void* FloydSteinbergDitherTask(void *params) {
+    TParam *p = (TParam*)params;
 
-    fclose(fp);
-    return img;
+    DitherNearest(p->pixels, p->size, p->palette, p->result);
+    return NULL;
 }
 
-void writePPM(const char *filename, RGBImage *img) {
-    FILE *fp;
-    //open file for output
-    fp = fopen(filename, "wb");
-    if (!fp) {
-         fprintf(stderr, "Unable to open file '%s'\n", filename);
-         exit(1);
+static void* CopyRowsTask(void *params) {
+    TCopyParam *p = (TCopyParam*)params;
+    int first, rows, r;
+    long rowSize = (long)p->src.width * sizeof(RGBTriple);
+
+    if (p->interleave) {
+        for (r = p->id; r < p->src.height; r += p->num_threads)
+            memcpy(p->dst.pixels + (long)r * p->src.width, p->src.pixels + (long)r * p->src.width, rowSize);
+    } else {
+        BandRows(p->src.height, p->num_threads, p->id, &first, &rows);
+        memcpy(p->dst.pixels + (long)first * p->src.width, p->src.pixels + (long)first * p->src.width,
+               rows * rowSize);
     }
 
-    //write the header file
-
-    //image format
-    fprintf(fp, "P6\n");
-
-    //comments
-    fprintf(fp, "# Created by %s\n",CREATOR);
-
-    //image size
-    fprintf(fp, "%d %d\n",img->width,img->height);
+    return NULL;
+}
 
-    // rgb component depth
-    fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
+// copies src into dst (same size) with every worker touching the rows it
+// will later work on, so their pages are allocated on its node
+static void CopyRowsLocal(RGBImage src, RGBImage dst, int num_threads, int interleave) {
+    ThreadPool *pool = PoolShared(num_threads);
+    TCopyParam p[num_threads];
+    int i;
 
-    // pixel data
-    fwrite(img->pixels, 3 * img->width, img->height, fp);
-    fclose(fp);
+    for (i = 0; i < num_threads; i++) {
+        p[i].id = i;
+        p[i].num_threads = num_threads;
+        p[i].interleave = interleave;
+        p[i].src = src;
+        p[i].dst = dst;
+        PoolSubmitTo(pool, i, &CopyRowsTask, &p[i]);
+    }
+    PoolWait(pool);
 }
 
-void* FloydSteinbergDitherTask(void *params) {
-    TParam *p = (TParam*)params;
-    int distanceSquared, minDistanceSquared, Rdiff, Gdiff, Bdiff, error;
-    unsigned char index, i;
-    RGBTriple color;
-    long k;
-
-    for (k = 0; k < p->size; k++) {
-        
-        color = p->pixels[k];
-        // FindNearestColor
-
-        minDistanceSquared = 255*255 + 255*255 + 255*255 + 1;
-        for (i = 0; i < 16; i++) {
-            Rdiff = ((int)color.R) - p->palette.table[i].R;
-            Gdiff = ((int)color.G) - p->palette.table[i].G;
-            Bdiff = ((int)color.B) - p->palette.table[i].B;
-            distanceSquared = Rdiff*Rdiff + Gdiff*Gdiff + Bdiff*Bdiff;
-            if (distanceSquared < minDistanceSquared) {
-                minDistanceSquared = distanceSquared;
-                index = i;
-            }
-        }
+// DITHER_NUMA=local: a fresh copy of the image whose bands were first touched
+// by the workers that dither them; the workers only stay on their node when
+// pinned (DITHER_PIN=1)
+static RGBImage *LocalImage(const RGBImage *image, int num_threads) {
+    RGBImage *local = (RGBImage*)malloc(sizeof(RGBImage));
+    const char *pin = getenv("DITHER_PIN");
 
-        {
-        compute_disperse(R);
-        compute_disperse(G);
-        compute_disperse(B);
-        }
-        p->result[k] = index;
+    if (local) {
+        *local = *image;
+        local->pixels = (RGBTriple*)malloc((long)image->width * image->height * sizeof(RGBTriple));
     }
+    if (!local || !local->pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    if (!pin || strcmp(pin, "1") != 0)
+        fprintf(stderr, "DITHER_NUMA=local without DITHER_PIN=1, the workers may leave their node\n");
+    CopyRowsLocal(*image, *local, num_threads, 0);
 
-    return NULL;
+    return local;
 }
 
-PalettizedImage FloydSteinbergDitherThreads(RGBImage image, RGBPalette palette, int num_threads)
+static PalettizedImage FloydSteinbergDitherThreads(RGBImage image, RGBPalette palette, int num_threads)
 {
     PalettizedImage result;
     result.width = image.width;
     result.height = image.height;
-    int i;
-    long size;
-    pthread_t threads[num_threads];
-    RGBTriple *pixels;
-    RGBTriple *table;
+    int i, first, rows;
+    ThreadPool *pool = PoolShared(num_threads);
     TParam p[num_threads];
 
     result.pixels = (unsigned char *)malloc(sizeof(unsigned char) * result.width * result.height);
-    size = result.width * result.height / num_threads;
+    if (!result.pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
 
     // threads vs OPEN MP
     // avantaj threaduri - pot separa accesul la image.pixels - exclusive read
     // avantaj threaduri - vizibilitate mai buna asupra variabilelor
-    // dezavantaj threaduri - master thread creaza cate o copie pt tabela de pixeli
     // avantaj threaduri peste MPI - scrierea se face in paralel
     for (i = 0; i < num_threads; i++) {
-        pixels = (RGBTriple*)malloc(size * sizeof(RGBTriple));
-        memcpy(pixels, image.pixels + i*size, size * sizeof(RGBTriple));
-        table = (RGBTriple*)malloc(sizeof(RGBTriple) * 16);
-        memcpy(table, palette.table, sizeof(RGBTriple) * 16);
-
-        p[i].size = size;
-        p[i].pixels = pixels;
-        p[i].result = result.pixels + i*size;
-        p[i].palette.size = palette.size;
-        p[i].palette.table = table;
+        // whole rows for every thread, covering the image; each slice is
+        // read straight from the image, without a private copy
+        BandRows(image.height, num_threads, i, &first, &rows);
+        p[i].size = (long)rows * image.width;
+        p[i].pixels = image.pixels + (long)first * image.width;
+        p[i].result = result.pixels + (long)first * image.width;
+        p[i].palette = palette;
         //FloydSteinbergDitherTask(&p);
-        if (pthread_create(&threads[i], NULL, &FloydSteinbergDitherTask, &p[i]))
-            perror("pthread_create");
+        // with DITHER_NUMA=local band i always runs (and writes its result) on worker i
+        if (NumaLocal())
+            PoolSubmitTo(pool, i, &FloydSteinbergDitherTask, &p[i]);
+        else
+            PoolSubmit(pool, &FloydSteinbergDitherTask, &p[i]);
     }
 
-    for (i = 0; i < num_threads; i++) {
-        if (pthread_join(threads[i], NULL))
-            perror("pthread_join");
-    }
+    PoolWait(pool);
 
     return result;
 }
 
+// the same work as FloydSteinbergDitherThreads, cut into tiles of tile_rows
+// rows and spread with the work-stealing scheduler
+static PalettizedImage FloydSteinbergDitherThreadsSteal(RGBImage image, RGBPalette palette, int num_threads,
+                                                        int tile_rows)
+{
+    PalettizedImage result;
 
-void writePal(const char *filename, RGBPalette palette, PalettizedImage result, RGBImage image) {
-    FILE *fp;
-    //open file for output
-    fp = fopen(filename, "wb");
-    if (!fp) {
-         fprintf(stderr, "Unable to open file '%s'\n", filename);
+    result.width = image.width;
+    result.height = image.height;
+    result.pixels = (unsigned char *)malloc(sizeof(unsigned char) * result.width * result.height);
+    if (!result.pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
          exit(1);
     }
 
-    //write the header file
-    //image format
-    fprintf(fp, "P6\n");
+    StealDitherNearest(PoolShared(num_threads), num_threads, image.pixels, result.pixels, palette,
+                       image.width, image.height, tile_rows);
 
-    //comments
-    fprintf(fp, "# Created by %s\n",CREATOR);
+    return result;
+}
 
-    //image size
-    fprintf(fp, "%d %d\n",result.width,result.height);
+static PalettizedImage FloydSteinbergDitherThreadsPipeline(RGBImage image, RGBPalette palette,
+                                                           const DitherKernel *kernel, int serpentine,
+                                                           int num_threads, int lag)
+{
+    PalettizedImage result;
+    RGBImage work;
+    RowProgress *progress;
+    ThreadPool *pool = PoolShared(num_threads);
+    PipelineParam p[num_threads];
+    long size;
+    int i;
 
-    // rgb component depth
-    fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
+    result.width = image.width;
+    result.height = image.height;
+    size = (long)image.width * image.height;
+    result.pixels = (unsigned char *)malloc(sizeof(unsigned char) * size);
+
+    // one shared working copy: the error is pushed across row ownership
+    work = image;
+    work.pixels = (RGBTriple*)malloc(size * sizeof(RGBTriple));
+    progress = (RowProgress*)malloc(image.height * sizeof(RowProgress));
+    if (!result.pixels || !work.pixels || !progress) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    if (NumaLocal())
+        CopyRowsLocal(image, work, num_threads, 1);
+    else
+        memcpy(work.pixels, image.pixels, size * sizeof(RGBTriple));
+    PipelineReset(progress, image.height);
 
+    if (lag < KernelLag(kernel))
+        lag = KernelLag(kernel);
 
-    int x, y;
-    for(y = 0; y < result.height; y++) {
-        for(x = 0; x < result.width; x++) {
-            fwrite(&palette.table[result.pixels[x + y*image.width]],
-                   3, 1, fp);
-        }
+    for (i = 0; i < num_threads; i++) {
+        p[i].id = i;
+        p[i].num_threads = num_threads;
+        p[i].lag = lag;
+        p[i].kernel = kernel;
+        p[i].serpentine = serpentine;
+        p[i].image = work;
+        p[i].result = result.pixels;
+        p[i].palette = palette;
+        p[i].progress = progress;
+        if (NumaLocal())
+            PoolSubmitTo(pool, i, &DitherPipelineTask, &p[i]);
+        else
+            PoolSubmit(pool, &DitherPipelineTask, &p[i]);
     }
 
-    fclose(fp);
+    PoolWait(pool);
+
+    // stderr, so run.sh still only sees the TIME line; only when profiling,
+    // not on every DITHER_REPEAT or benchmark run
+    for (i = 0; i < num_threads && prof_enabled; i++)
+        fprintf(stderr, "thread %d stall = %lf\n", i, p[i].stall);
+
+    free(progress);
+    free(work.pixels);
+    return result;
 }
 
-int main(int argc, char* argv[]){
 
-    if (argc != 3) {
-        printf("Call <floyd> <num_threads> <input>\n");
+int RunThreads(int argc, char* argv[]){
+    int check = CheckArgument(&argc, argv), status = 0;
+
+    if (argc < 3 || argc > 5) {
+        printf("Call <floyd> <num_threads> <input> [pipeline [lag] | steal [tile_rows]] [check]\n");
         exit(1);
     }
     
-    int num_threads;
+    int num_threads, repeat, i, mapped;
+    int pipeline = argc > 3 && strcmp(argv[3], "pipeline") == 0;
+    int steal = argc > 3 && strcmp(argv[3], "steal") == 0;
+    int lag = argc > 4 ? atoi(argv[4]) : DEFAULT_LAG;
+    int tile_rows = argc > 4 ? atoi(argv[4]) : DEFAULT_TILE_ROWS;
     char input[MAX_FILE_NAME_SIZE];
     struct timeval t1, t2;
     double elapsedTime;
@@ -289,68 +242,79 @@ int main(int argc, char* argv[]){
     RGBImage *image;
     RGBPalette palette;
     PalettizedImage result;
+    const DitherKernel *kernel = loadKernel();
+    int serpentine = SerpentineScan();
 
     num_threads = atoi(argv[1]);
+    if (num_threads < 1) {
+        printf("Call <floyd> <num_threads> <input> [pipeline [lag] | steal [tile_rows]] [check]\n");
+        exit(1);
+    }
 
-    palette.size = 16;
-    palette.table = (RGBTriple*)malloc(sizeof(RGBTriple) * 16);
-    palette.table[0].R = 149;
-    palette.table[0].G = 91;
-    palette.table[0].B = 110;
-    palette.table[1].R = 176;
-    palette.table[1].G = 116;
-    palette.table[1].B = 137;
-    palette.table[2].R = 17;
-    palette.table[2].G = 11;
-    palette.table[2].B = 15;
-    palette.table[3].R = 63;
-    palette.table[3].G = 47;
-    palette.table[3].B = 69;
-    palette.table[4].R = 93;
-    palette.table[4].G = 75;
-    palette.table[4].B = 112;
-    palette.table[5].R = 47;
-    palette.table[5].G = 62;
-    palette.table[5].B = 24;
-    palette.table[6].R = 76;
-    palette.table[6].G = 90;
-    palette.table[6].B = 55;
-    palette.table[7].R = 190;
-    palette.table[7].G = 212;
-    palette.table[7].B = 115;
-    palette.table[8].R = 160;
-    palette.table[8].G = 176;
-    palette.table[8].B = 87;
-    palette.table[9].R = 116;
-    palette.table[9].G = 120;
-    palette.table[9].B = 87;
-    palette.table[10].R = 245;
-    palette.table[10].G = 246;
-    palette.table[10].B = 225;
-    palette.table[11].R = 148;
-    palette.table[11].G = 146;
-    palette.table[11].B = 130;
-    palette.table[12].R = 200;
-    palette.table[12].G = 195;
-    palette.table[12].B = 180;
-    palette.table[13].R = 36;
-    palette.table[13].G = 32;
-    palette.table[13].B = 27;
-    palette.table[14].R = 87;
-    palette.table[14].G = 54;
-    palette.table[14].B = 45;
-    palette.table[15].R = 121;
-    palette.table[15].G = 72;
-    palette.table[15].B = 72;
+    palette = loadPalette();
+    ProfStart();
 
     strcpy(input, argv[2]);
     
-    image = readPPM(input);
+    gettimeofday(&t1, NULL);
+    mapped = getenv("DITHER_MMAP") != NULL;
+    image = mapped ? mapPPM(input) : readPPM(input);
+    reportLoad(&t1);
+
+    if (NumaLocal()) {
+        RGBImage *local;
+
+        gettimeofday(&t1, NULL);
+        local = LocalImage(image, num_threads);
+        if (mapped) {
+            unmapPPM(image);
+        } else {
+            free(image->pixels);
+            free(image);
+        }
+        image = local;
+        mapped = 0;
+        gettimeofday(&t2, NULL);
+        elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;
+        elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
+        fprintf(stderr, "FIRST TOUCH TIME = %lf\n", elapsedTime);
+    }
+
+    SetupPalette(&palette, *image, num_threads, PoolRunWorkers);
+
+    // the workers start here, not inside the timed call (with DITHER_NUMA=local
+    // they already did, to first-touch the image)
+    PoolShared(num_threads);
+
+    // DITHER_REPEAT=n dithers the image n times more, the way a batch job
+    // would, and reports the mean time per image on stderr
+    repeat = getenv("DITHER_REPEAT") ? atoi(getenv("DITHER_REPEAT")) : 0;
+    gettimeofday(&t1, NULL);
+    for (i = 0; i < repeat; i++) {
+        if (pipeline)
+            result = FloydSteinbergDitherThreadsPipeline(*image, palette, kernel, serpentine, num_threads, lag);
+        else if (steal)
+            result = FloydSteinbergDitherThreadsSteal(*image, palette, num_threads, tile_rows);
+        else
+            result = FloydSteinbergDitherThreads(*image, palette, num_threads);
+        free(result.pixels);
+    }
+    gettimeofday(&t2, NULL);
+    if (repeat > 0) {
+        elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
+        elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
+        fprintf(stderr, "REPEAT = %d, mean = %lf\n", repeat, elapsedTime / repeat);
+    }
 
-    printf("Threads ");
+    printf(pipeline ? "Threads_Pipeline " : steal ? "Threads_Steal " : "Threads ");
     // start timer
     gettimeofday(&t1, NULL);    
-    result = FloydSteinbergDitherThreads(*image, palette, num_threads);
+    if (pipeline)
+        result = FloydSteinbergDitherThreadsPipeline(*image, palette, kernel, serpentine, num_threads, lag);
+    else if (steal)
+        result = FloydSteinbergDitherThreadsSteal(*image, palette, num_threads, tile_rows);
+    else
+        result = FloydSteinbergDitherThreads(*image, palette, num_threads);
     // stop timer
     gettimeofday(&t2, NULL);
 
@@ -358,10 +322,48 @@ int main(int argc, char* argv[]){
     elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
     elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
     printf ("TIME = %lf\n", elapsedTime); 
-    writePal(OUTPUT_FILE, palette, result, *image);
+    ProfReport(pipeline ? "Threads_Pipeline" : steal ? "Threads_Steal" : "Threads", -1);
+    writePal(OUTPUT_FILE, palette, result, num_threads, PoolRunWorkers);
+
+    // DITHER_BENCH: the same read, dither and write again, with per-phase statistics
+    if (BenchStart()) {
+        do {
+            free(result.pixels);
+            BenchReadPPM(input);
+            BenchBegin("compute");
+            if (pipeline)
+                result = FloydSteinbergDitherThreadsPipeline(*image, palette, kernel, serpentine, num_threads, lag);
+            else if (steal)
+                result = FloydSteinbergDitherThreadsSteal(*image, palette, num_threads, tile_rows);
+            else
+                result = FloydSteinbergDitherThreads(*image, palette, num_threads);
+            BenchEnd();
+            BenchBegin("write");
+            writePal(OUTPUT_FILE, palette, result, num_threads, PoolRunWorkers);
+            BenchEnd();
+        } while (BenchNext());
+        BenchReport(pipeline ? "Threads_Pipeline" : steal ? "Threads_Steal" : "Threads", (long)image->width * image->height, 1);
+    }
+
+    // the pipeline diffuses the error, the slices and tiles only map every pixel
+    if (check)
+        status = !CheckResult(result, *image, palette, pipeline ? kernel : FindKernel("nearest"),
+                              pipeline && serpentine);
 
-    free(image->pixels);
-    free(image);
+    if (mapped) {
+        unmapPPM(image);
+    } else {
+        free(image->pixels);
+        free(image);
+    }
+    free(result.pixels);
+    PoolSharedDestroy();
+
+    return status;
+}
 
-    return 0;
+#ifndef DITHER_DRIVER
+int main(int argc, char* argv[]) {
+    return RunThreads(argc, argv);
 }
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include <sys/time.h>
+
+#include "dither.h"
+#include "palette.h"
+#include "ppm.h"
+#include "bench.h"
+#include "prof.h"
+#include "backends.h"
+
+#define MAX_FILE_NAME_SIZE 60
+#define OUTPUT_FILE "outwf.ppm"
+#define DEFAULT_BLOCK_WIDTH 32
+
+
+// Diagonal wavefront: the image is cut into column blocks and row r works on
+// block (step - r * blockLag) at every step, so consecutive rows stay the
+// kernel's lag apart. Rows active in the same step never touch the same
+// pixels, and the barrier at the end of each step publishes their error.
+// In serpentine order a row needs the whole row above, so a block is a whole
+// row and the steps run one row each.
+static PalettizedImage FloydSteinbergDitherWavefront(RGBImage image, RGBPalette palette,
+                                                     const DitherKernel *kernel, int serpentine,
+                                                     int blockWidth) {
+    PalettizedImage result;
+    RGBTriple *pixels;
+    long size;
+    int numBlocks, blockLag, steps;
+
+    result.width = image.width;
+    result.height = image.height;
+    size = (long)image.width * image.height;
+    result.pixels = (unsigned char*)malloc(sizeof(unsigned char) * size);
+    pixels = (RGBTriple*)malloc(size * sizeof(RGBTriple));
+    if (!result.pixels || !pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    memcpy(pixels, image.pixels, size * sizeof(RGBTriple));
+
+    if (blockWidth < 2)
+        blockWidth = 2;
+    if (serpentine)
+        blockWidth = image.width;
+    numBlocks = (image.width + blockWidth - 1) / blockWidth;
+    // row r-1 must be past column x + lag - 1 when row r reaches x
+    blockLag = serpentine ? 1 : 2 + (KernelLag(kernel) - 2) / blockWidth;
+    steps = numBlocks + blockLag * (image.height - 1);
+
+    #pragma omp parallel
+    {
+        int step, r, rmin, rmax, block, x0, x1;
+
+        for (step = 0; step < steps; step++) {
+            rmin = step - numBlocks + 1 <= 0 ? 0 : (step - numBlocks + blockLag) / blockLag;
+            rmax = step / blockLag;
+            if (rmax > image.height - 1)
+                rmax = image.height - 1;
+
+            #pragma omp for schedule(static) nowait
+            for (r = rmin; r <= rmax; r++) {
+                block = step - r * blockLag;
+                x0 = block * blockWidth;
+                x1 = x0 + blockWidth < image.width ? x0 + blockWidth : image.width;
+                DitherSpan(kernel, pixels + (long)r * image.width, image.width, image.height - 1 - r,
+                           x0, x1, serpentine && (r & 1), palette, result.pixels + (long)r * image.width);
+            }
+
+            // the step barrier, timed apart from the spans
+            ProfBegin(PROF_WAIT);
+            #pragma omp barrier
+            ProfEnd(PROF_WAIT);
+        }
+    }
+
+    free(pixels);
+    return result;
+}
+
+int RunWavefront(int argc, char* argv[]){
+    int check = CheckArgument(&argc, argv), status = 0;
+
+    if (argc < 2 || argc > 3) {
+        printf("call <floyd> input [block_width] [check]\n");
+        exit(1);
+    }
+    
+    int blockWidth = DEFAULT_BLOCK_WIDTH;
+    char input[MAX_FILE_NAME_SIZE];
+    struct timeval t1, t2;
+    double elapsedTime;
+
+    RGBImage *image;
+    RGBPalette palette;
+    PalettizedImage result;
+    const DitherKernel *kernel = loadKernel();
+    int serpentine = SerpentineScan();
+
+    palette = loadPalette();
+    ProfStart();
+
+    
+    strcpy(input, argv[1]);
+    if (argc > 2)
+        blockWidth = atoi(argv[2]);
+
+    gettimeofday(&t1, NULL);
+    image = getenv("DITHER_MMAP") ? mapPPM(input) : readPPM(input);
+    reportLoad(&t1);
+
+    SetupPalette(&palette, *image, omp_get_max_threads(), RunWorkersOMP);
+
+    printf("Wavefront ");
+    // start timer
+    gettimeofday(&t1, NULL);    
+    result = FloydSteinbergDitherWavefront(*image, palette, kernel, serpentine, blockWidth);
+    // stop timer
+    gettimeofday(&t2, NULL);
+
+    // compute and print the elapsed time in millisec
+    elapsedTime = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
+    elapsedTime += (t2.tv_usec - t1.tv_usec) / 1000.0;
+    printf ("TIME = %lf\n", elapsedTime); 
+    ProfReport("Wavefront", -1);
+    writePal(OUTPUT_FILE, palette, result, omp_get_max_threads(), RunWorkersOMP);
+
+    // DITHER_BENCH: the same read, dither and write again, with per-phase statistics
+    if (BenchStart()) {
+        do {
+            free(result.pixels);
+            BenchReadPPM(input);
+            BenchBegin("compute");
+            result = FloydSteinbergDitherWavefront(*image, palette, kernel, serpentine, blockWidth);
+            BenchEnd();
+            BenchBegin("write");
+            writePal(OUTPUT_FILE, palette, result, omp_get_max_threads(), RunWorkersOMP);
+            BenchEnd();
+        } while (BenchNext());
+        BenchReport("Wavefront", (long)image->width * image->height, 1);
+    }
+
+    // compare against the serial reference in the same order
+    if (check)
+        status = !CheckResult(result, *image, palette, kernel, serpentine);
+
+    free(result.pixels);
+
+    if (getenv("DITHER_MMAP")) {
+        unmapPPM(image);
+    } else {
+        free(image->pixels);
+        free(image);
+    }
+
+    return status;
+}
+
+#ifndef DITHER_DRIVER
+int main(int argc, char* argv[]) {
+    return RunWavefront(argc, argv);
+}
+#endif
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dither.h"
+#include "palette.h"
+#include "palette_search.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "libdither.h"
+
+typedef struct {
+    DitherContext *context;
+    long first, last;
+} DitherJob;
+
+struct DitherContext {
+    DitherOptions options;
+    RGBPalette palette;
+    ThreadPool *pool;           // NULL with one thread
+
+    // reused from one image to the next, grown when a bigger one comes
+    RGBTriple *work;
+    long workSize;
+    RowProgress *progress;
+    int progressRows;
+
+    DitherJob *jobs;            // lookup table ranges, one per thread
+    PipelineParam *rows;        // one per pipeline thread
+};
+
+void DitherDefaultOptions(DitherOptions *options) {
+    options->threads = 1;
+    options->lutBits = 0;
+    options->lag = DEFAULT_LAG;
+    options->kernel = NULL;
+    options->simd = NULL;
+    options->search = NULL;
+    options->pinFirst = -1;
+}
+
+static void *build_lut_job(void *params) {
+    DitherJob *job = (DitherJob*)params;
+    long c;
+
+    for (c = job->first; c < job->last; c += LUT_CHUNK)
+        PaletteSearchBuildLUT(job->context->palette, c, c + LUT_CHUNK < job->last ? c + LUT_CHUNK : job->last);
+    return NULL;
+}
+
+static int build_lut(DitherContext *context) {
+    int threads = context->options.threads, i;
+    long cells = PaletteSearchTryAllocLUT(context->palette, context->options.lutBits);
+
+    if (!cells)
+        return DITHER_ENOMEM;
+    for (i = 0; i < threads; i++) {
+        context->jobs[i].first = cells * i / threads;
+        context->jobs[i].last = cells * (i + 1) / threads;
+        if (context->pool)
+            PoolSubmit(context->pool, &build_lut_job, &context->jobs[i]);
+        else
+            build_lut_job(&context->jobs[i]);
+    }
+    if (context->pool)
+        PoolWait(context->pool);
+    PaletteSearchEnableLUT(context->palette);
+
+    return DITHER_OK;
+}
+
+int DitherCreate(const RGBPalette *palette, const DitherOptions *options, DitherContext **context) {
+    DitherContext *c;
+    int i, status;
+
+    if (!context)
+        return DITHER_EINVAL;
+    *context = NULL;
+    if (!palette || !palette->table || palette->size < MIN_PALETTE_SIZE || palette->size > MAX_PALETTE_SIZE)
+        return DITHER_EINVAL;
+
+    c = (DitherContext*)calloc(1, sizeof(DitherContext));
+    if (!c)
+        return DITHER_ENOMEM;
+    if (options)
+        c->options = *options;
+    else
+        DitherDefaultOptions(&c->options);
+    if (c->options.threads < 1)
+        c->options.threads = 1;
+    if (!c->options.kernel)
+        c->options.kernel = FindKernel("floyd");
+    if (c->options.lag < KernelLag(c->options.kernel))
+        c->options.lag = KernelLag(c->options.kernel);
+
+    c->palette.size = palette->size;
+    c->palette.table = (RGBTriple*)malloc(palette->size * sizeof(RGBTriple));
+    c->jobs = (DitherJob*)calloc(c->options.threads, sizeof(DitherJob));
+    c->rows = (PipelineParam*)calloc(c->options.threads, sizeof(PipelineParam));
+    if (!c->palette.table || !c->jobs || !c->rows) {
+        DitherDestroy(c);
+        return DITHER_ENOMEM;
+    }
+    memcpy(c->palette.table, palette->table, palette->size * sizeof(RGBTriple));
+    status = PaletteSearchSetup(&c->palette, c->options.simd, c->options.search, 0);
+    if (status != 0) {
+        DitherDestroy(c);
+        return status == PALETTE_SEARCH_EINVAL ? DITHER_EINVAL : DITHER_ENOMEM;
+    }
+
+    for (i = 0; i < c->options.threads; i++) {
+        c->jobs[i].context = c;
+        c->rows[i].id = i;
+        c->rows[i].num_threads = c->options.threads;
+        c->rows[i].lag = c->options.lag;
+        c->rows[i].kernel = c->options.kernel;
+        c->rows[i].palette = c->palette;
+    }
+    if (c->options.threads > 1) {
+        c->pool = PoolTryCreate(c->options.threads, c->options.pinFirst);
+        if (!c->pool) {
+            DitherDestroy(c);
+            return DITHER_ENOMEM;
+        }
+    }
+    if (c->options.lutBits > 0 && build_lut(c) != DITHER_OK) {
+        DitherDestroy(c);
+        return DITHER_ENOMEM;
+    }
+
+    *context = c;
+    return DITHER_OK;
+}
+
+void DitherDestroy(DitherContext *context) {
+    if (!context)
+        return;
+    if (context->pool)
+        PoolDestroy(context->pool);
+    PaletteSearchFree(&context->palette);
+    free(context->palette.table);
+    free(context->jobs);
+    free(context->rows);
+    free(context->work);
+    free(context->progress);
+    free(context);
+}
+
+int DitherContextRun(DitherContext *context, const RGBImage *image, PalettizedImage *out) {
+    long size;
+    int i;
+
+    if (!context || !image || !image->pixels || !out || !out->pixels || image->width < 1 || image->height < 1)
+        return DITHER_EINVAL;
+
+    // the error is pushed into the pixels, so work on a copy of the input
+    size = (long)image->width * image->height;
+    if (size > context->workSize) {
+        free(context->work);
+        context->work = (RGBTriple*)malloc(size * sizeof(RGBTriple));
+        context->workSize = context->work ? size : 0;
+    }
+    if (image->height > context->progressRows) {
+        free(context->progress);
+        context->progress = (RowProgress*)malloc(image->height * sizeof(RowProgress));
+        context->progressRows = context->progress ? image->height : 0;
+    }
+    if (!context->work || !context->progress)
+        return DITHER_ENOMEM;
+    memcpy(context->work, image->pixels, size * sizeof(RGBTriple));
+    PipelineReset(context->progress, image->height);
+
+    out->width = image->width;
+    out->height = image->height;
+    for (i = 0; i < context->options.threads; i++) {
+        context->rows[i].image = *image;
+        context->rows[i].image.pixels = context->work;
+        context->rows[i].result = out->pixels;
+        context->rows[i].progress = context->progress;
+    }
+
+    if (!context->pool) {
+        DitherPipelineTask(&context->rows[0]);
+        return DITHER_OK;
+    }
+    for (i = 0; i < context->options.threads; i++)
+        PoolSubmit(context->pool, &DitherPipelineTask, &context->rows[i]);
+    PoolWait(context->pool);
+
+    return DITHER_OK;
+}
+
+int dither(const RGBImage *image, const RGBPalette *palette, const DitherOptions *options,
+           PalettizedImage *out) {
+    DitherContext *context;
+    int status = DitherCreate(palette, options, &context);
+
+    if (status != DITHER_OK)
+        return status;
+    status = DitherContextRun(context, image, out);
+    DitherDestroy(context);
+
+    return status;
+}
@@ -0,0 +1,54 @@
+#ifndef LIBDITHER_H
+#define LIBDITHER_H
+
+#include "dither.h"
+
+// In-process error-diffusion dithering for callers that link the library
+// instead of running the programs: no MPI, no files, nothing printed, no
+// environment variables read and no exit; every failure comes back as an
+// error code. A context owns everything that outlives one image (a copy of the
+// palette with its search structures and lookup table, the worker pool and
+// the working buffers), so a service creates it once and then dithers frame
+// after frame into buffers it supplies. The result is the serial reference
+// bit for bit, whatever the number of threads.
+//
+// A context dithers one image at a time; concurrent callers need one each.
+
+#define DITHER_OK 0
+#define DITHER_EINVAL (-1)
+#define DITHER_ENOMEM (-2)      // out of memory, or of threads for the pool
+
+typedef struct {
+    int threads;        // pool workers; 1 dithers on the calling thread
+    int lutBits;        // palette lookup table of 2^(3*lutBits) cells, 0 for none
+    int lag;            // columns a row runs behind the one above, at least KernelLag(kernel)
+    const DitherKernel *kernel;     // from FindKernel; NULL for Floyd-Steinberg
+    const char *simd;   // avx2, sse4.1 or scalar (or the widest below it the CPU has); NULL for the widest
+    const char *search; // linear or kdtree; NULL races the two once per context
+    int pinFirst;       // workers pinned to CPUs pinFirst, pinFirst + 1, ...; -1 leaves them floating
+} DitherOptions;
+
+typedef struct DitherContext DitherContext;
+
+// one thread, no lookup table, the pipeline's default lag, Floyd-Steinberg,
+// the widest search kernel, the faster search method and no pinning
+void DitherDefaultOptions(DitherOptions *options);
+
+// copies the palette (MIN_PALETTE_SIZE to MAX_PALETTE_SIZE colours) and
+// builds its search; NULL options mean the defaults. Returns DITHER_OK and
+// the context in *context, or DITHER_EINVAL (also for an unknown simd or
+// search name) / DITHER_ENOMEM with *context NULL.
+int DitherCreate(const RGBPalette *palette, const DitherOptions *options, DitherContext **context);
+void DitherDestroy(DitherContext *context);
+
+// dithers image into out->pixels, which the caller allocates with at least
+// width * height bytes; out->width and out->height are set to the image's.
+// DITHER_ENOMEM when the working buffers cannot grow to the image; the
+// context stays usable.
+int DitherContextRun(DitherContext *context, const RGBImage *image, PalettizedImage *out);
+
+// one-shot form: a context for this image only
+int dither(const RGBImage *image, const RGBPalette *palette, const DitherOptions *options,
+           PalettizedImage *out);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libdither.h"
+#include "palette.h"
+#include "palette_search.h"
+
+// Dithers synthetic frames through libdither.h with several thread counts,
+// lookup tables and kernels, and compares every result byte for byte with
+// DitherSerial. Each context dithers two frames of different sizes, so the
+// working buffers are reused and grown. Prints one line per configuration
+// and exits with 1 on the first mismatch or error.
+
+#define FRAMES 2
+
+static const int frameWidth[FRAMES] = {157, 640};
+static const int frameHeight[FRAMES] = {93, 211};
+
+static const int threadCounts[] = {1, 3, 8};
+static const int lutBits[] = {0, 5};
+static const char *kernels[] = {"floyd", "jjn", "atkinson"};
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+// gradients with a little hashed noise, so every frame has many colours and
+// no two rows dither the same
+static RGBImage make_frame(int width, int height, unsigned int seed) {
+    RGBImage image;
+    unsigned int h;
+    long k;
+    int x, y;
+
+    image.width = width;
+    image.height = height;
+    image.pixels = (RGBTriple*)malloc((long)width * height * sizeof(RGBTriple));
+    if (!image.pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            k = (long)y * width + x;
+            h = (unsigned int)k * 0x9e3779b9u ^ seed;
+            h ^= h >> 15;
+            h *= 0x846ca68b;
+            h ^= h >> 16;
+            image.pixels[k].R = (unsigned char)(255 * x / width + (h & 15));
+            image.pixels[k].G = (unsigned char)(255 * y / height + ((h >> 8) & 15));
+            image.pixels[k].B = (unsigned char)(255 * (x + y) / (width + height) + ((h >> 16) & 15));
+        }
+    }
+
+    return image;
+}
+
+int main(void) {
+    RGBImage frames[FRAMES];
+    RGBPalette palette = defaultPalette();
+    PalettizedImage out, reference;
+    DitherOptions options;
+    DitherContext *context;
+    int t, l, n, f, status, failed = 0;
+
+    // the reference and the library both search linearly, with no SIMD
+    // preference, so nothing is raced or printed
+    if (PaletteSearchSetup(&palette, NULL, "linear", 0) != 0) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    for (f = 0; f < FRAMES; f++)
+        frames[f] = make_frame(frameWidth[f], frameHeight[f], (unsigned int)f + 1);
+
+    out.pixels = (unsigned char*)malloc((long)frameWidth[FRAMES - 1] * frameHeight[FRAMES - 1]);
+    if (!out.pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    for (n = 0; n < COUNT(kernels); n++) {
+        for (t = 0; t < COUNT(threadCounts); t++) {
+            for (l = 0; l < COUNT(lutBits); l++) {
+                DitherDefaultOptions(&options);
+                options.threads = threadCounts[t];
+                options.lutBits = lutBits[l];
+                options.kernel = FindKernel(kernels[n]);
+
+                status = DitherCreate(&palette, &options, &context);
+                if (status != DITHER_OK) {
+                    printf("%s threads=%d lut=%d: DitherCreate failed (%d)\n",
+                           kernels[n], options.threads, options.lutBits, status);
+                    exit(1);
+                }
+
+                for (f = 0; f < FRAMES; f++) {
+                    status = DitherContextRun(context, &frames[f], &out);
+                    if (status != DITHER_OK) {
+                        printf("%s threads=%d lut=%d %dx%d: DitherContextRun failed (%d)\n",
+                               kernels[n], options.threads, options.lutBits,
+                               frames[f].width, frames[f].height, status);
+                        exit(1);
+                    }
+
+                    reference = DitherSerial(frames[f], palette, options.kernel, 0);
+                    if (out.width != reference.width || out.height != reference.height
+                        || memcmp(out.pixels, reference.pixels, (long)out.width * out.height) != 0)
+                        failed = 1;
+                    printf("%s threads=%d lut=%d %dx%d: %s\n", kernels[n], options.threads,
+                           options.lutBits, frames[f].width, frames[f].height, failed ? "MISMATCH" : "OK");
+                    free(reference.pixels);
+                    if (failed)
+                        exit(1);
+                }
+
+                DitherDestroy(context);
+            }
+        }
+    }
+
+    free(out.pixels);
+    for (f = 0; f < FRAMES; f++)
+        free(frames[f].pixels);
+    PaletteSearchFree(&palette);
+    free(palette.table);
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+#include "palette.h"
+#include "palette_gen.h"
+#include "palette_search.h"
+
+// shared by the workers of HistogramWorkers
+typedef struct {
+    const RGBTriple *pixels;
+    long count;
+    atomic_long next;
+    unsigned long **hists;      // one per worker
+} HistogramWork;
+
+// shared by the workers of BuildLUTWorkers
+typedef struct {
+    RGBPalette palette;
+    long last;
+    atomic_long next;
+} LUTWork;
+
+static const RGBTriple DEFAULT_PALETTE[] = {
+    {149,  91, 110}, {176, 116, 137}, { 17,  11,  15}, { 63,  47,  69},
+    { 93,  75, 112}, { 47,  62,  24}, { 76,  90,  55}, {190, 212, 115},
+    {160, 176,  87}, {116, 120,  87}, {245, 246, 225}, {148, 146, 130},
+    {200, 195, 180}, { 36,  32,  27}, { 87,  54,  45}, {121,  72,  72},
+};
+
+RGBPalette defaultPalette(void) {
+    RGBPalette palette;
+
+    palette.size = sizeof(DEFAULT_PALETTE) / sizeof(DEFAULT_PALETTE[0]);
+    palette.table = (RGBTriple*)malloc(sizeof(DEFAULT_PALETTE));
+    if (!palette.table) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    memcpy(palette.table, DEFAULT_PALETTE, sizeof(DEFAULT_PALETTE));
+    palette.search = NULL;
+
+    return palette;
+}
+
+RGBPalette readPalette(const char *filename) {
+    RGBPalette palette;
+    FILE *fp;
+    char line[256], *p;
+    int R, G, B, lineNum = 0;
+
+    //open palette file for reading
+    fp = fopen(filename, "r");
+    if (!fp) {
+         fprintf(stderr, "Unable to open file '%s'\n", filename);
+         exit(1);
+    }
+
+    palette.size = 0;
+    palette.table = (RGBTriple*)malloc(sizeof(RGBTriple) * MAX_PALETTE_SIZE);
+    palette.search = NULL;
+    if (!palette.table) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineNum++;
+        for (p = line; isspace((unsigned char)*p); p++) ;
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (strncmp(p, "GIMP Palette", 12) == 0 || strncmp(p, "Name:", 5) == 0
+            || strncmp(p, "Columns:", 8) == 0)
+            continue;
+
+        if (sscanf(p, "%d %d %d", &R, &G, &B) != 3) {
+             fprintf(stderr, "Invalid colour on line %d (error loading '%s')\n", lineNum, filename);
+             exit(1);
+        }
+        if (R < 0 || R > 255 || G < 0 || G > 255 || B < 0 || B > 255) {
+             fprintf(stderr, "Colour on line %d is not 8-bit (error loading '%s')\n", lineNum, filename);
+             exit(1);
+        }
+        if (palette.size == MAX_PALETTE_SIZE) {
+             fprintf(stderr, "More than %d colours (error loading '%s')\n", MAX_PALETTE_SIZE, filename);
+             exit(1);
+        }
+
+        palette.table[palette.size].R = R;
+        palette.table[palette.size].G = G;
+        palette.table[palette.size].B = B;
+        palette.size++;
+    }
+    fclose(fp);
+
+    if (palette.size < MIN_PALETTE_SIZE) {
+         fprintf(stderr, "Fewer than %d colours (error loading '%s')\n", MIN_PALETTE_SIZE, filename);
+         exit(1);
+    }
+
+    return palette;
+}
+
+RGBPalette loadPalette(void) {
+    const char *filename = getenv("DITHER_PALETTE");
+
+    return filename ? readPalette(filename) : defaultPalette();
+}
+
+static void histogram_work(void *arg, int id) {
+    HistogramWork *w = (HistogramWork*)arg;
+    unsigned long *hist = HistogramAlloc();
+    long k;
+
+    while ((k = atomic_fetch_add(&w->next, HIST_CHUNK)) < w->count)
+        HistogramAdd(hist, w->pixels + k, k + HIST_CHUNK < w->count ? HIST_CHUNK : w->count - k);
+    w->hists[id] = hist;
+}
+
+unsigned long *HistogramWorkers(const RGBTriple *pixels, long count, int workers, RunWorkersFunc run) {
+    unsigned long *hist = HistogramAlloc();
+    HistogramWork w;
+    int i;
+
+    w.pixels = pixels;
+    w.count = count;
+    atomic_init(&w.next, 0);
+    w.hists = (unsigned long**)malloc(workers * sizeof(unsigned long*));
+    if (!w.hists) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    run(workers, &histogram_work, &w);
+    for (i = 0; i < workers; i++) {
+        HistogramMerge(hist, w.hists[i]);
+        free(w.hists[i]);
+    }
+    free(w.hists);
+
+    return hist;
+}
+
+static void lut_work(void *arg, int id) {
+    LUTWork *w = (LUTWork*)arg;
+    long c;
+
+    while ((c = atomic_fetch_add(&w->next, LUT_CHUNK)) < w->last)
+        PaletteSearchBuildLUT(w->palette, c, c + LUT_CHUNK < w->last ? c + LUT_CHUNK : w->last);
+}
+
+void BuildLUTWorkers(RGBPalette palette, long first, long last, int workers, RunWorkersFunc run) {
+    LUTWork w;
+
+    w.palette = palette;
+    w.last = last;
+    atomic_init(&w.next, first);
+    run(workers, &lut_work, &w);
+}
+
+static double ms_since(const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+void SetupPalette(RGBPalette *palette, RGBImage image, int workers, RunWorkersFunc run) {
+    struct timeval t1;
+    unsigned long *hist;
+
+    // stderr, so run.sh still only sees the TIME line
+    if (getenv("DITHER_COLORS")) {
+        gettimeofday(&t1, NULL);
+        hist = HistogramWorkers(image.pixels, (long)image.width * image.height, workers, run);
+        free(palette->table);
+        *palette = PaletteFromHistogram(hist, atoi(getenv("DITHER_COLORS")));
+        free(hist);
+        fprintf(stderr, "PALETTE TIME = %lf\n", ms_since(&t1));
+    }
+
+    PaletteSearchInit(palette);
+
+    if (getenv("DITHER_LUT")) {
+        gettimeofday(&t1, NULL);
+        BuildLUTWorkers(*palette, 0, PaletteSearchAllocLUT(*palette, atoi(getenv("DITHER_LUT"))), workers, run);
+        PaletteSearchEnableLUT(*palette);
+        fprintf(stderr, "LUT TIME = %lf\n", ms_since(&t1));
+    }
+}
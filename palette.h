@@ -0,0 +1,34 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include "dither.h"
+
+#define MIN_PALETTE_SIZE 2
+#define MAX_PALETTE_SIZE 256
+
+// the 16 colours every variant used to hard-code
+RGBPalette defaultPalette(void);
+
+// one "R G B" triple per line; blank lines, '#' comments and the header lines
+// of a GIMP .gpl palette are skipped, and anything after the triple is ignored
+RGBPalette readPalette(const char *filename);
+
+// the palette named by DITHER_PALETTE, or the default one
+RGBPalette loadPalette(void);
+
+// colour histogram of count pixels, one private histogram per worker, the
+// pixels taken HIST_CHUNK at a time
+unsigned long *HistogramWorkers(const RGBTriple *pixels, long count, int workers, RunWorkersFunc run);
+
+// cells [first, last) of the lookup table allocated by PaletteSearchAllocLUT,
+// LUT_CHUNK cells at a time by whichever worker is free
+void BuildLUTWorkers(RGBPalette palette, long first, long last, int workers, RunWorkersFunc run);
+
+// The steps every backend runs between loading the image and dithering it,
+// on its own workers: DITHER_COLORS replaces the palette with one of that
+// many colours generated from the image, the search is set up, and DITHER_LUT
+// builds the lookup table with that many bits per channel. The palette and
+// lookup table times go to stderr.
+void SetupPalette(RGBPalette *palette, RGBImage image, int workers, RunWorkersFunc run);
+
+#endif
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "palette.h"
+#include "palette_gen.h"
+
+#define HIST_SHIFT (8 - HIST_BITS)
+
+// a non-empty histogram bin, with its mean colour
+typedef struct {
+    int color[3];
+    unsigned long count, sum[3];
+} HistBin;
+
+// bins [lo, hi) of the sorted bin array
+typedef struct {
+    int lo, hi, axis, range;
+    unsigned long count;
+} Box;
+
+unsigned long *HistogramAlloc(void) {
+    unsigned long *hist = (unsigned long*)calloc(HIST_SIZE, sizeof(unsigned long));
+
+    if (!hist) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    return hist;
+}
+
+void HistogramAdd(unsigned long *hist, const RGBTriple *pixels, long count) {
+    unsigned long *bin;
+    long k;
+
+    for (k = 0; k < count; k++) {
+        bin = hist + 4 * ((((pixels[k].R >> HIST_SHIFT) << HIST_BITS) | (pixels[k].G >> HIST_SHIFT)) << HIST_BITS
+                          | (pixels[k].B >> HIST_SHIFT));
+        bin[0]++;
+        bin[1] += pixels[k].R;
+        bin[2] += pixels[k].G;
+        bin[3] += pixels[k].B;
+    }
+}
+
+void HistogramMerge(unsigned long *into, const unsigned long *from) {
+    long i;
+
+    for (i = 0; i < HIST_SIZE; i++)
+        into[i] += from[i];
+}
+
+static HistBin *collect_bins(const unsigned long *hist, int *numBins) {
+    HistBin *bins;
+    int i, k, n = 0;
+
+    for (i = 0; i < HIST_BINS; i++)
+        n += hist[4 * i] > 0;
+
+    bins = (HistBin*)malloc((n + 1) * sizeof(HistBin));
+    if (!bins) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    n = 0;
+    for (i = 0; i < HIST_BINS; i++) {
+        if (hist[4 * i] == 0)
+            continue;
+        bins[n].count = hist[4 * i];
+        for (k = 0; k < 3; k++) {
+            bins[n].sum[k] = hist[4 * i + 1 + k];
+            bins[n].color[k] = (int)((bins[n].sum[k] + bins[n].count / 2) / bins[n].count);
+        }
+        n++;
+    }
+
+    *numBins = n;
+    return bins;
+}
+
+static void measure_box(const HistBin *bins, Box *box) {
+    int min[3], max[3], i, k;
+
+    box->count = 0;
+    for (k = 0; k < 3; k++) {
+        min[k] = 255;
+        max[k] = 0;
+    }
+    for (i = box->lo; i < box->hi; i++) {
+        box->count += bins[i].count;
+        for (k = 0; k < 3; k++) {
+            if (bins[i].color[k] < min[k])
+                min[k] = bins[i].color[k];
+            if (bins[i].color[k] > max[k])
+                max[k] = bins[i].color[k];
+        }
+    }
+
+    box->axis = 0;
+    box->range = -1;
+    for (k = 0; k < 3; k++) {
+        if (max[k] - min[k] > box->range) {
+            box->range = max[k] - min[k];
+            box->axis = k;
+        }
+    }
+}
+
+// one comparator per axis, so the sort needs no shared state
+static int compare_bins_R(const void *a, const void *b) {
+    return ((const HistBin*)a)->color[0] - ((const HistBin*)b)->color[0];
+}
+
+static int compare_bins_G(const void *a, const void *b) {
+    return ((const HistBin*)a)->color[1] - ((const HistBin*)b)->color[1];
+}
+
+static int compare_bins_B(const void *a, const void *b) {
+    return ((const HistBin*)a)->color[2] - ((const HistBin*)b)->color[2];
+}
+
+static int (*const compare_bins[3])(const void*, const void*) = {compare_bins_R, compare_bins_G, compare_bins_B};
+
+static RGBTriple mean_color(const unsigned long *sum, unsigned long count) {
+    RGBTriple color;
+
+    color.R = (unsigned char)((sum[0] + count / 2) / count);
+    color.G = (unsigned char)((sum[1] + count / 2) / count);
+    color.B = (unsigned char)((sum[2] + count / 2) / count);
+    return color;
+}
+
+RGBPalette MedianCutPalette(const unsigned long *hist, int colors) {
+    RGBPalette palette;
+    HistBin *bins;
+    Box *boxes;
+    unsigned long half, seen, sum[3];
+    int numBins, numBoxes, best, split, i, k;
+
+    bins = collect_bins(hist, &numBins);
+    boxes = (Box*)malloc(colors * sizeof(Box));
+    palette.table = (RGBTriple*)malloc((colors > MIN_PALETTE_SIZE ? colors : MIN_PALETTE_SIZE) * sizeof(RGBTriple));
+    palette.search = NULL;
+    if (!boxes || !palette.table) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    numBoxes = 1;
+    boxes[0].lo = 0;
+    boxes[0].hi = numBins;
+    measure_box(bins, &boxes[0]);
+
+    while (numBoxes < colors) {
+        // split the most populated box that still spans more than one colour
+        best = -1;
+        for (i = 0; i < numBoxes; i++) {
+            if (boxes[i].range > 0 && (best < 0 || boxes[i].count > boxes[best].count))
+                best = i;
+        }
+        if (best < 0)
+            break;
+
+        qsort(bins + boxes[best].lo, boxes[best].hi - boxes[best].lo, sizeof(HistBin),
+              compare_bins[boxes[best].axis]);
+
+        // weighted median, keeping at least one bin on each side
+        half = boxes[best].count / 2;
+        seen = 0;
+        for (split = boxes[best].lo; split < boxes[best].hi - 1; split++) {
+            seen += bins[split].count;
+            if (seen >= half)
+                break;
+        }
+        split++;
+
+        boxes[numBoxes].lo = split;
+        boxes[numBoxes].hi = boxes[best].hi;
+        boxes[best].hi = split;
+        measure_box(bins, &boxes[best]);
+        measure_box(bins, &boxes[numBoxes]);
+        numBoxes++;
+    }
+
+    palette.size = numBoxes;
+    for (i = 0; i < numBoxes; i++) {
+        sum[0] = sum[1] = sum[2] = 0;
+        for (k = boxes[i].lo; k < boxes[i].hi; k++) {
+            sum[0] += bins[k].sum[0];
+            sum[1] += bins[k].sum[1];
+            sum[2] += bins[k].sum[2];
+        }
+        palette.table[i] = boxes[i].count ? mean_color(sum, boxes[i].count) : (RGBTriple){0, 0, 0};
+    }
+
+    // an image of fewer colours than that cannot fill MIN_PALETTE_SIZE
+    // entries; the rest are the complements of the first ones
+    for (; palette.size < MIN_PALETTE_SIZE; palette.size++) {
+        RGBTriple color = palette.table[palette.size - numBoxes];
+
+        palette.table[palette.size] = (RGBTriple){255 - color.R, 255 - color.G, 255 - color.B};
+    }
+
+    free(boxes);
+    free(bins);
+    return palette;
+}
+
+void KMeansPalette(const unsigned long *hist, RGBPalette *palette, int iterations) {
+    HistBin *bins;
+    unsigned long *sums;
+    int Rdiff, Gdiff, Bdiff, distanceSquared, minDistanceSquared;
+    int numBins, iteration, i, j, index, moved;
+
+    bins = collect_bins(hist, &numBins);
+    sums = (unsigned long*)malloc(4 * palette->size * sizeof(unsigned long));
+    if (!sums) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    for (iteration = 0; iteration < iterations; iteration++) {
+        memset(sums, 0, 4 * palette->size * sizeof(unsigned long));
+
+        // every bin goes to the nearest centre, weighted by its pixel count
+        for (i = 0; i < numBins; i++) {
+            index = 0;
+            minDistanceSquared = 255*255 + 255*255 + 255*255 + 1;
+            for (j = 0; j < palette->size; j++) {
+                Rdiff = bins[i].color[0] - palette->table[j].R;
+                Gdiff = bins[i].color[1] - palette->table[j].G;
+                Bdiff = bins[i].color[2] - palette->table[j].B;
+                distanceSquared = Rdiff*Rdiff + Gdiff*Gdiff + Bdiff*Bdiff;
+                if (distanceSquared < minDistanceSquared) {
+                    minDistanceSquared = distanceSquared;
+                    index = j;
+                }
+            }
+            sums[4 * index] += bins[i].count;
+            sums[4 * index + 1] += bins[i].sum[0];
+            sums[4 * index + 2] += bins[i].sum[1];
+            sums[4 * index + 3] += bins[i].sum[2];
+        }
+
+        // empty clusters keep their centre
+        moved = 0;
+        for (j = 0; j < palette->size; j++) {
+            RGBTriple centre;
+
+            if (sums[4 * j] == 0)
+                continue;
+            centre = mean_color(sums + 4 * j + 1, sums[4 * j]);
+            moved |= centre.R != palette->table[j].R || centre.G != palette->table[j].G
+                     || centre.B != palette->table[j].B;
+            palette->table[j] = centre;
+        }
+        if (!moved)
+            break;
+    }
+
+    free(sums);
+    free(bins);
+}
+
+RGBPalette PaletteFromHistogram(const unsigned long *hist, int colors) {
+    const char *quantizer = getenv("DITHER_QUANTIZER");
+    RGBPalette palette;
+
+    if (colors < MIN_PALETTE_SIZE)
+        colors = MIN_PALETTE_SIZE;
+    if (colors > MAX_PALETTE_SIZE)
+        colors = MAX_PALETTE_SIZE;
+    palette = MedianCutPalette(hist, colors);
+    if (quantizer && strcmp(quantizer, "kmeans") == 0)
+        KMeansPalette(hist, &palette, KMEANS_ITERATIONS);
+
+    return palette;
+}
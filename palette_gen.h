@@ -0,0 +1,32 @@
+#ifndef PALETTE_GEN_H
+#define PALETTE_GEN_H
+
+#include "dither.h"
+
+// colours are binned on 5 bits per channel; every bin keeps its pixel count
+// and the sum of each channel, so boxes and clusters get exact mean colours
+#define HIST_BITS 5
+#define HIST_BINS (1 << (3 * HIST_BITS))
+#define HIST_SIZE (4 * HIST_BINS)
+
+#define KMEANS_ITERATIONS 10
+// pixels a worker adds to its histogram at a time
+#define HIST_CHUNK 65536
+
+// zeroed histogram of HIST_SIZE counters; backends keep one per thread
+// (or per rank) and merge them, since all fields are plain sums
+unsigned long *HistogramAlloc(void);
+void HistogramAdd(unsigned long *hist, const RGBTriple *pixels, long count);
+void HistogramMerge(unsigned long *into, const unsigned long *from);
+
+// median cut down to at most `colors` entries, and never fewer than
+// MIN_PALETTE_SIZE: an image with fewer colours gets their complements too
+RGBPalette MedianCutPalette(const unsigned long *hist, int colors);
+
+// Lloyd iterations over the histogram bins, starting from `palette`
+void KMeansPalette(const unsigned long *hist, RGBPalette *palette, int iterations);
+
+// median cut, refined by k-means when DITHER_QUANTIZER=kmeans
+RGBPalette PaletteFromHistogram(const unsigned long *hist, int colors);
+
+#endif
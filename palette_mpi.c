@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <mpi.h>
+
+#include "palette.h"
+#include "palette_gen.h"
+#include "palette_search.h"
+#include "ppm_mpi.h"
+#include "palette_mpi.h"
+
+static double ms_since(const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static RGBPalette GeneratePaletteMPI(RGBImage image, int colors, int num_procs, int proc_num,
+                                     int workers, RunWorkersFunc run) {
+    unsigned long *hist;
+    RGBPalette palette;
+    RGBTriple *band;
+    int *counts, *displs;
+    int i, first, rows;
+
+    counts = (int*)malloc(2 * num_procs * sizeof(int));
+    if (!counts) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    displs = counts + num_procs;
+    for (i = 0; i < num_procs; i++) {
+        WeightedBandRows(image.height, num_procs, i, &first, &rows);
+        counts[i] = rows * image.width * 3;
+        displs[i] = first * image.width * 3;
+    }
+    WeightedBandRows(image.height, num_procs, proc_num, &first, &rows);
+    band = (RGBTriple*)malloc(sizeof(RGBTriple) * rows * image.width + 1);
+    if (!band) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    scatterPPM(image.pixels, counts, displs, band, proc_num);
+    hist = HistogramWorkers(band, (long)rows * image.width, workers, run);
+    free(band);
+    free(counts);
+
+    MPI_Reduce(proc_num == 0 ? MPI_IN_PLACE : hist, hist, HIST_SIZE, MPI_UNSIGNED_LONG,
+               MPI_SUM, 0, MPI_COMM_WORLD);
+    if (proc_num == 0)
+        palette = PaletteFromHistogram(hist, colors);
+    free(hist);
+
+    MPI_Bcast(&palette.size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (proc_num != 0) {
+        palette.table = (RGBTriple*)malloc(sizeof(RGBTriple) * palette.size);
+        if (!palette.table) {
+             fprintf(stderr, "Unable to allocate memory\n");
+             exit(1);
+        }
+    }
+    palette.search = NULL;
+    MPI_Bcast(palette.table, palette.size * 3, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+
+    return palette;
+}
+
+static void BuildLUTMPI(RGBPalette palette, int bits, int num_procs, int proc_num,
+                        int workers, RunWorkersFunc run) {
+    long cells = PaletteSearchAllocLUT(palette, bits);
+    long share = cells / LUT_CHUNK / num_procs, extra = cells / LUT_CHUNK % num_procs;
+    long first, last;
+    int *counts, *displs;
+    int i;
+
+    counts = (int*)malloc(2 * num_procs * sizeof(int));
+    if (!counts) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    displs = counts + num_procs;
+
+    // whole slabs of LUT_CHUNK cells per rank, counted in bytes for the exchange
+    for (i = 0; i < num_procs; i++) {
+        first = (i * share + (i < extra ? i : extra)) * LUT_CHUNK;
+        last = first + (share + (i < extra)) * LUT_CHUNK;
+        displs[i] = first * sizeof(LUTCell);
+        counts[i] = (last - first) * sizeof(LUTCell);
+    }
+    first = displs[proc_num] / sizeof(LUTCell);
+    last = first + counts[proc_num] / sizeof(LUTCell);
+
+    BuildLUTWorkers(palette, first, last, workers, run);
+
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, palette.search->lut, counts, displs,
+                   MPI_BYTE, MPI_COMM_WORLD);
+    free(counts);
+
+    PaletteSearchEnableLUT(palette);
+}
+
+void SetupPaletteMPI(RGBPalette *palette, RGBImage image, int num_procs, int proc_num,
+                     int workers, RunWorkersFunc run) {
+    struct timeval t1;
+
+    // stderr, so run.sh still only sees the TIME line
+    if (getenv("DITHER_COLORS")) {
+        gettimeofday(&t1, NULL);
+        free(palette->table);
+        *palette = GeneratePaletteMPI(image, atoi(getenv("DITHER_COLORS")), num_procs, proc_num, workers, run);
+        if (proc_num == 0)
+            fprintf(stderr, "PALETTE TIME = %lf\n", ms_since(&t1));
+    }
+
+    PaletteSearchInit(palette);
+
+    if (getenv("DITHER_LUT")) {
+        gettimeofday(&t1, NULL);
+        BuildLUTMPI(*palette, atoi(getenv("DITHER_LUT")), num_procs, proc_num, workers, run);
+        if (proc_num == 0)
+            fprintf(stderr, "LUT TIME = %lf\n", ms_since(&t1));
+    }
+}
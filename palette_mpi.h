@@ -0,0 +1,15 @@
+#ifndef PALETTE_MPI_H
+#define PALETTE_MPI_H
+
+#include "dither.h"
+
+// SetupPalette across the ranks, each running its share on its own workers.
+// DITHER_COLORS: every rank histograms its own band of rows, the histograms
+// are summed on rank 0 with MPI_Reduce, and rank 0 broadcasts the palette it
+// builds. DITHER_LUT: every rank builds its share of the lookup table, then
+// the shares are exchanged so each rank ends up with the whole table. The
+// times go to stderr from rank 0.
+void SetupPaletteMPI(RGBPalette *palette, RGBImage image, int num_procs, int proc_num,
+                     int workers, RunWorkersFunc run);
+
+#endif
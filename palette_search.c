@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "palette.h"
+#include "palette_search.h"
+#include "prof.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// far enough from [0, 255]^3 to never win, small enough not to overflow an int
+#define PADDING_COLOR (-1024)
+
+static unsigned char find_scalar(const PaletteSearch *search, RGBTriple color) {
+    int Rdiff, Gdiff, Bdiff, distanceSquared, minDistanceSquared;
+    int i, index = 0;
+
+    minDistanceSquared = 255*255 + 255*255 + 255*255 + 1;
+    for (i = 0; i < search->size; i++) {
+        Rdiff = ((int)color.R) - search->R[i];
+        Gdiff = ((int)color.G) - search->G[i];
+        Bdiff = ((int)color.B) - search->B[i];
+        distanceSquared = Rdiff*Rdiff + Gdiff*Gdiff + Bdiff*Bdiff;
+        if (distanceSquared < minDistanceSquared) {
+            minDistanceSquared = distanceSquared;
+            index = i;
+        }
+    }
+
+    return (unsigned char)index;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Every lane keeps the smallest distance it has seen and, thanks to the strict
+// compare, the lowest index reaching it. The reduction takes the minimum
+// distance over the lanes, then the minimum index among the lanes that hold
+// it, which is exactly what the scalar first-wins loop returns.
+__attribute__((target("sse4.1")))
+static int hmin_sse41(__m128i v) {
+    v = _mm_min_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_min_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse4.1")))
+static unsigned char find_sse41(const PaletteSearch *search, RGBTriple color) {
+    __m128i r = _mm_set1_epi32(color.R);
+    __m128i g = _mm_set1_epi32(color.G);
+    __m128i b = _mm_set1_epi32(color.B);
+    __m128i best = _mm_set1_epi32(INT_MAX);
+    __m128i bestIndex = _mm_setzero_si128();
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i step = _mm_set1_epi32(4);
+    __m128i dr, dg, db, distance, closer;
+    int i, minDistance;
+
+    for (i = 0; i < search->padded; i += 4) {
+        dr = _mm_sub_epi32(r, _mm_load_si128((const __m128i*)(search->R + i)));
+        dg = _mm_sub_epi32(g, _mm_load_si128((const __m128i*)(search->G + i)));
+        db = _mm_sub_epi32(b, _mm_load_si128((const __m128i*)(search->B + i)));
+        distance = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)),
+                                 _mm_mullo_epi32(db, db));
+        closer = _mm_cmplt_epi32(distance, best);
+        best = _mm_min_epi32(best, distance);
+        bestIndex = _mm_blendv_epi8(bestIndex, index, closer);
+        index = _mm_add_epi32(index, step);
+    }
+
+    minDistance = hmin_sse41(best);
+    closer = _mm_cmpeq_epi32(best, _mm_set1_epi32(minDistance));
+    bestIndex = _mm_blendv_epi8(_mm_set1_epi32(INT_MAX), bestIndex, closer);
+    return (unsigned char)hmin_sse41(bestIndex);
+}
+
+__attribute__((target("avx2")))
+static int hmin_avx2(__m256i v) {
+    __m128i h = _mm_min_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    h = _mm_min_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)));
+    h = _mm_min_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(h);
+}
+
+__attribute__((target("avx2")))
+static unsigned char find_avx2(const PaletteSearch *search, RGBTriple color) {
+    __m256i r = _mm256_set1_epi32(color.R);
+    __m256i g = _mm256_set1_epi32(color.G);
+    __m256i b = _mm256_set1_epi32(color.B);
+    __m256i best = _mm256_set1_epi32(INT_MAX);
+    __m256i bestIndex = _mm256_setzero_si256();
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i step = _mm256_set1_epi32(8);
+    __m256i dr, dg, db, distance, closer;
+    int i, minDistance;
+
+    for (i = 0; i < search->padded; i += 8) {
+        dr = _mm256_sub_epi32(r, _mm256_load_si256((const __m256i*)(search->R + i)));
+        dg = _mm256_sub_epi32(g, _mm256_load_si256((const __m256i*)(search->G + i)));
+        db = _mm256_sub_epi32(b, _mm256_load_si256((const __m256i*)(search->B + i)));
+        distance = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)),
+                                    _mm256_mullo_epi32(db, db));
+        closer = _mm256_cmpgt_epi32(best, distance);
+        best = _mm256_min_epi32(best, distance);
+        bestIndex = _mm256_blendv_epi8(bestIndex, index, closer);
+        index = _mm256_add_epi32(index, step);
+    }
+
+    minDistance = hmin_avx2(best);
+    closer = _mm256_cmpeq_epi32(best, _mm256_set1_epi32(minDistance));
+    bestIndex = _mm256_blendv_epi8(_mm256_set1_epi32(INT_MAX), bestIndex, closer);
+    return (unsigned char)hmin_avx2(bestIndex);
+}
+
+#endif
+
+// orders entries[lo, hi) by channel value, then by index; palettes hold at
+// most MAX_PALETTE_SIZE entries, so an insertion sort is enough
+static void kd_sort(int *entries, int lo, int hi, const int *channel) {
+    int i, j, entry;
+
+    for (i = lo + 1; i < hi; i++) {
+        entry = entries[i];
+        for (j = i; j > lo; j--) {
+            if (channel[entries[j - 1]] < channel[entry]
+                || (channel[entries[j - 1]] == channel[entry] && entries[j - 1] < entry))
+                break;
+            entries[j] = entries[j - 1];
+        }
+        entries[j] = entry;
+    }
+}
+
+// splits entries[lo, hi) on the median of the channel with the widest spread
+static int kd_build(PaletteSearch *search, int *entries, int lo, int hi, int *used) {
+    int *channels[3] = {search->R, search->G, search->B};
+    int axis, bestAxis = 0, spread, bestSpread = -1, min, max;
+    int i, mid, node;
+
+    if (lo >= hi)
+        return -1;
+
+    for (axis = 0; axis < 3; axis++) {
+        min = max = channels[axis][entries[lo]];
+        for (i = lo + 1; i < hi; i++) {
+            if (channels[axis][entries[i]] < min)
+                min = channels[axis][entries[i]];
+            if (channels[axis][entries[i]] > max)
+                max = channels[axis][entries[i]];
+        }
+        spread = max - min;
+        if (spread > bestSpread) {
+            bestSpread = spread;
+            bestAxis = axis;
+        }
+    }
+
+    kd_sort(entries, lo, hi, channels[bestAxis]);
+    mid = (lo + hi) / 2;
+
+    node = (*used)++;
+    search->kd[node].index = entries[mid];
+    search->kd[node].axis = bestAxis;
+    for (axis = 0; axis < 3; axis++)
+        search->kd[node].color[axis] = channels[axis][entries[mid]];
+    search->kd[node].left = kd_build(search, entries, lo, mid, used);
+    search->kd[node].right = kd_build(search, entries, mid + 1, hi, used);
+
+    return node;
+}
+
+// Branch and bound: the far side of a split is only skipped when the plane is
+// strictly farther than the best match, so equally near entries are still
+// visited and the lowest index wins as in the linear scan.
+static void kd_search(const KDNode *kd, int node, const int *color, int *best, int *bestIndex) {
+    const KDNode *n;
+    int diff, d, i;
+
+    if (node < 0)
+        return;
+
+    n = kd + node;
+    d = 0;
+    for (i = 0; i < 3; i++)
+        d += (color[i] - n->color[i]) * (color[i] - n->color[i]);
+    if (d < *best || (d == *best && n->index < *bestIndex)) {
+        *best = d;
+        *bestIndex = n->index;
+    }
+
+    diff = color[n->axis] - n->color[n->axis];
+    kd_search(kd, diff < 0 ? n->left : n->right, color, best, bestIndex);
+    if (diff * diff <= *best)
+        kd_search(kd, diff < 0 ? n->right : n->left, color, best, bestIndex);
+}
+
+static unsigned char find_kdtree(const PaletteSearch *search, RGBTriple color) {
+    int c[3] = {color.R, color.G, color.B};
+    int best = INT_MAX, bestIndex = INT_MAX;
+
+    kd_search(search->kd, search->kdRoot, c, &best, &bestIndex);
+    return (unsigned char)bestIndex;
+}
+
+// nanoseconds per lookup over a fixed pseudo-random sample of colours
+static double time_search(const PaletteSearch *search,
+                          unsigned char (*find)(const PaletteSearch*, RGBTriple)) {
+    struct timespec start, stop;
+    unsigned int seed = 12345, sum = 0;
+    RGBTriple color;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < KD_CALIBRATION_SAMPLES; i++) {
+        seed = seed * 1103515245 + 12345;
+        color.R = seed >> 8;
+        color.G = seed >> 16;
+        color.B = seed >> 24;
+        sum += find(search, color);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    // keep the loop from being optimised away
+    if (sum == UINT_MAX)
+        fprintf(stderr, " ");
+    return ((stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec)) / KD_CALIBRATION_SAMPLES;
+}
+
+// method NULL races the two on a sample of colours and reports the pick when
+// `report` is set; -1 when the tree cannot be allocated
+static int pick_search_method(PaletteSearch *search, const char *method, int report) {
+    int *entries, i, used = 0;
+    double linear, kdtree;
+
+    search->method = "linear";
+    if (search->size < KD_MIN_SIZE && !(method && strcmp(method, "kdtree") == 0))
+        return 0;
+
+    search->kd = (KDNode*)malloc(search->size * sizeof(KDNode));
+    entries = (int*)malloc(search->size * sizeof(int));
+    if (!search->kd || !entries) {
+        free(entries);
+        return -1;
+    }
+    for (i = 0; i < search->size; i++)
+        entries[i] = i;
+    search->kdRoot = kd_build(search, entries, 0, search->size, &used);
+    free(entries);
+
+    if (method) {
+        if (strcmp(method, "kdtree") == 0) {
+            search->method = "kdtree";
+            search->find = find_kdtree;
+        }
+        return 0;
+    }
+
+    // warm both up once, then race them
+    time_search(search, search->find);
+    time_search(search, find_kdtree);
+    linear = time_search(search, search->find);
+    kdtree = time_search(search, find_kdtree);
+    if (kdtree < linear) {
+        search->method = "kdtree";
+        search->find = find_kdtree;
+    }
+    if (report)
+        fprintf(stderr, "SEARCH = %s (linear %s %.1lf ns, kdtree %.1lf ns per colour, %d colours)\n",
+                search->method, search->kernel, linear, kdtree, search->size);
+    return 0;
+}
+
+static int known_simd(const char *simd) {
+    return !simd || strcmp(simd, "avx2") == 0 || strcmp(simd, "sse4.1") == 0 || strcmp(simd, "scalar") == 0;
+}
+
+static int known_method(const char *method) {
+    return !method || strcmp(method, "linear") == 0 || strcmp(method, "kdtree") == 0;
+}
+
+int PaletteSearchSetup(RGBPalette *palette, const char *simd, const char *method, int report) {
+    PaletteSearch *search;
+    int i;
+
+    palette->search = NULL;
+    if (!known_simd(simd) || !known_method(method))
+        return PALETTE_SEARCH_EINVAL;
+
+    search = (PaletteSearch*)calloc(1, sizeof(PaletteSearch));
+    if (!search)
+        return PALETTE_SEARCH_ENOMEM;
+    palette->search = search;
+
+    search->size = palette->size;
+    search->padded = (palette->size + PALETTE_SEARCH_LANES - 1) / PALETTE_SEARCH_LANES * PALETTE_SEARCH_LANES;
+    search->R = (int*)aligned_alloc(32, search->padded * sizeof(int));
+    search->G = (int*)aligned_alloc(32, search->padded * sizeof(int));
+    search->B = (int*)aligned_alloc(32, search->padded * sizeof(int));
+    if (!search->R || !search->G || !search->B) {
+        PaletteSearchFree(palette);
+        return PALETTE_SEARCH_ENOMEM;
+    }
+    for (i = 0; i < search->padded; i++) {
+        search->R[i] = i < palette->size ? palette->table[i].R : PADDING_COLOR;
+        search->G[i] = i < palette->size ? palette->table[i].G : PADDING_COLOR;
+        search->B[i] = i < palette->size ? palette->table[i].B : PADDING_COLOR;
+    }
+
+    search->lutBits = 0;
+    search->lut = NULL;
+    search->kd = NULL;
+    search->kdRoot = -1;
+    search->kernel = "scalar";
+    search->find = find_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (!simd || strcmp(simd, "avx2") == 0)) {
+        search->kernel = "avx2";
+        search->find = find_avx2;
+    } else if (__builtin_cpu_supports("sse4.1") && (!simd || strcmp(simd, "scalar") != 0)) {
+        search->kernel = "sse4.1";
+        search->find = find_sse41;
+    }
+#endif
+    if (pick_search_method(search, method, report) != 0) {
+        PaletteSearchFree(palette);
+        return PALETTE_SEARCH_ENOMEM;
+    }
+    search->exact = search->find;
+
+    return 0;
+}
+
+void PaletteSearchInit(RGBPalette *palette) {
+    const char *simd = getenv("DITHER_SIMD"), *method = getenv("DITHER_SEARCH");
+
+    if (!known_simd(simd)) {
+         fprintf(stderr, "Unknown DITHER_SIMD '%s', use avx2, sse4.1 or scalar\n", simd);
+         exit(1);
+    }
+    if (!known_method(method)) {
+         fprintf(stderr, "Unknown DITHER_SEARCH '%s', use linear or kdtree\n", method);
+         exit(1);
+    }
+    if (PaletteSearchSetup(palette, simd, method, 1) != 0) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    // benchmark numbers would otherwise be credited to the kernel asked for
+    if (simd && strcmp(simd, palette->search->kernel) != 0)
+        fprintf(stderr, "DITHER_SIMD=%s is not available on this CPU, using %s\n", simd, palette->search->kernel);
+}
+
+void PaletteSearchFree(RGBPalette *palette) {
+    if (!palette->search)
+        return;
+    free(palette->search->R);
+    free(palette->search->G);
+    free(palette->search->B);
+    free(palette->search->lut);
+    free(palette->search->kd);
+    free(palette->search);
+    palette->search = NULL;
+}
+
+static unsigned char find_lut(const PaletteSearch *search, RGBTriple color) {
+    int shift = 8 - search->lutBits;
+    const LUTCell *cell = search->lut + ((((long)(color.R >> shift) << search->lutBits)
+                                          | (color.G >> shift)) << search->lutBits | (color.B >> shift));
+    int Rdiff, Gdiff, Bdiff, distanceSquared, minDistanceSquared;
+    int i, k, index;
+
+    if (cell->count == 1)
+        return cell->index[0];
+    if (cell->count == 0)
+        return search->exact(search, color);
+
+    // candidates are sorted, so the strict compare still keeps the lowest index
+    index = cell->index[0];
+    minDistanceSquared = 255*255 + 255*255 + 255*255 + 1;
+    for (k = 0; k < cell->count; k++) {
+        i = cell->index[k];
+        Rdiff = ((int)color.R) - search->R[i];
+        Gdiff = ((int)color.G) - search->G[i];
+        Bdiff = ((int)color.B) - search->B[i];
+        distanceSquared = Rdiff*Rdiff + Gdiff*Gdiff + Bdiff*Bdiff;
+        if (distanceSquared < minDistanceSquared) {
+            minDistanceSquared = distanceSquared;
+            index = i;
+        }
+    }
+
+    return (unsigned char)index;
+}
+
+long PaletteSearchTryAllocLUT(RGBPalette palette, int bits) {
+    PaletteSearch *search = palette.search;
+    long cells;
+
+    if (bits < LUT_MIN_BITS)
+        bits = LUT_MIN_BITS;
+    if (bits > LUT_MAX_BITS)
+        bits = LUT_MAX_BITS;
+    cells = 1L << (3 * bits);
+
+    free(search->lut);
+    search->lut = (LUTCell*)malloc(cells * sizeof(LUTCell));
+    search->lutBits = search->lut ? bits : 0;
+    return search->lut ? cells : 0;
+}
+
+long PaletteSearchAllocLUT(RGBPalette palette, int bits) {
+    long cells = PaletteSearchTryAllocLUT(palette, bits);
+
+    if (!cells) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    return cells;
+}
+
+// squared distance from v to the closest and to the farthest point of [lo, hi]
+#define axis_distance(v, lo, hi, near, far) \
+    near = (v) < (lo) ? (lo) - (v) : ((v) > (hi) ? (v) - (hi) : 0); \
+    far = (v) - (lo) > (hi) - (v) ? (v) - (lo) : (hi) - (v);
+
+void PaletteSearchBuildLUT(RGBPalette palette, long first, long last) {
+    PaletteSearch *search = palette.search;
+    int bits = search->lutBits, shift = 8 - bits, mask = (1 << bits) - 1;
+    int nearest[MAX_PALETTE_SIZE];
+    int loR, loG, loB, hiR, hiG, hiB, near, far, farthest, bound;
+    int i, count;
+    long c;
+
+    for (c = first; c < last; c++) {
+        loR = (int)((c >> (2 * bits)) & mask) << shift;
+        loG = (int)((c >> bits) & mask) << shift;
+        loB = (int)(c & mask) << shift;
+        hiR = loR + (1 << shift) - 1;
+        hiG = loG + (1 << shift) - 1;
+        hiB = loB + (1 << shift) - 1;
+
+        // an entry can only win somewhere in the cell if its closest point is
+        // no farther than the farthest point of the best entry overall
+        bound = 3 * 256 * 256;
+        for (i = 0; i < search->size; i++) {
+            axis_distance(search->R[i], loR, hiR, near, far);
+            nearest[i] = near * near;
+            farthest = far * far;
+            axis_distance(search->G[i], loG, hiG, near, far);
+            nearest[i] += near * near;
+            farthest += far * far;
+            axis_distance(search->B[i], loB, hiB, near, far);
+            nearest[i] += near * near;
+            farthest += far * far;
+            if (farthest < bound)
+                bound = farthest;
+        }
+
+        count = 0;
+        for (i = 0; i < search->size && count <= LUT_MAX_CANDIDATES; i++) {
+            if (nearest[i] <= bound) {
+                if (count < LUT_MAX_CANDIDATES)
+                    search->lut[c].index[count] = (unsigned char)i;
+                count++;
+            }
+        }
+        search->lut[c].count = count <= LUT_MAX_CANDIDATES ? count : 0;
+    }
+}
+
+void PaletteSearchEnableLUT(RGBPalette palette) {
+    palette.search->find = find_lut;
+}
+
+unsigned char FindNearestColor(RGBTriple color, RGBPalette palette) {
+    if (prof_enabled)
+        return ProfFindNearestColor(color, palette);
+    return palette.search->find(palette.search, color);
+}
@@ -0,0 +1,75 @@
+#ifndef PALETTE_SEARCH_H
+#define PALETTE_SEARCH_H
+
+#include "dither.h"
+
+// palette laid out one channel per array for the vector kernels; the tail is
+// padded up to PALETTE_SEARCH_LANES with entries no colour can ever be nearest to
+#define PALETTE_SEARCH_LANES 8
+
+// palettes from this size on also get a k-d tree, raced against the linear scan
+#define KD_MIN_SIZE 24
+#define KD_CALIBRATION_SAMPLES 8192
+
+// k-d tree node over the palette entries; children are -1 when missing
+typedef struct {
+    int color[3];
+    int index, axis;
+    int left, right;
+} KDNode;
+
+// candidates kept per lookup table cell; busier cells fall back to the full search
+#define LUT_MAX_CANDIDATES 7
+#define LUT_MIN_BITS 3
+#define LUT_MAX_BITS 7
+// cells a worker builds at a time
+#define LUT_CHUNK 512
+
+// every palette entry that can be the nearest one for some colour of the cell,
+// in increasing index order; count 0 means there were too many to keep
+typedef struct {
+    unsigned char count;
+    unsigned char index[LUT_MAX_CANDIDATES];
+} LUTCell;
+
+typedef struct PaletteSearch {
+    int size, padded;
+    int *R, *G, *B;
+    const char *kernel, *method;
+    KDNode *kd;
+    int kdRoot;
+    unsigned char (*find)(const struct PaletteSearch *search, RGBTriple color);
+    unsigned char (*exact)(const struct PaletteSearch *search, RGBTriple color);
+    int lutBits;
+    LUTCell *lut;
+} PaletteSearch;
+
+#define PALETTE_SEARCH_ENOMEM (-1)
+#define PALETTE_SEARCH_EINVAL (-2)     // unknown simd or method name
+
+// Picks the widest kernel the CPU supports (AVX2, SSE4.1, then scalar), or
+// the one named by `simd` (avx2, sse4.1 or scalar); a kernel the CPU lacks
+// gives the widest one below it, named in search->kernel. Palettes of
+// KD_MIN_SIZE colours or more also build a k-d tree and keep whichever of the
+// two answers a sample of colours faster, or the one named by `method`
+// (linear or kdtree). The race is printed on stderr only when `report` is
+// set. Returns 0, or PALETTE_SEARCH_EINVAL / PALETTE_SEARCH_ENOMEM with
+// nothing left allocated; it never exits.
+int PaletteSearchSetup(RGBPalette *palette, const char *simd, const char *method, int report);
+
+// PaletteSearchSetup for the programs: DITHER_SIMD and DITHER_SEARCH pick, the
+// race is reported, an unknown name or running out of memory ends the
+// program, and a DITHER_SIMD kernel the CPU lacks is reported on stderr
+void PaletteSearchInit(RGBPalette *palette);
+void PaletteSearchFree(RGBPalette *palette);
+
+// RGB lookup table on a grid of 2^bits cells per channel. Cells are independent,
+// so every backend builds its own share with PaletteSearchBuildLUT and then
+// switches lookups over with PaletteSearchEnableLUT.
+long PaletteSearchAllocLUT(RGBPalette palette, int bits);
+// the same, returning 0 instead of exiting when the table cannot be allocated
+long PaletteSearchTryAllocLUT(RGBPalette palette, int bits);
+void PaletteSearchBuildLUT(RGBPalette palette, long first, long last);
+void PaletteSearchEnableLUT(RGBPalette palette);
+
+#endif
@@ -0,0 +1,76 @@
+#include <sched.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "prof.h"
+
+#define MAX_SPINS 1024
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static double elapsed_ms(struct timespec *start, struct timespec *stop) {
+    return (stop->tv_sec - start->tv_sec) * 1000.0 + (stop->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// spins on the row above until it has completed `needed` columns, backing
+// off exponentially and then yielding; returns the time spent waiting
+static double wait_for_row(RowProgress *above, int needed) {
+    struct timespec start, stop;
+    int spins = 1, i;
+
+    if (atomic_load_explicit(&above->done, memory_order_acquire) >= needed)
+        return 0;
+
+    ProfBegin(PROF_WAIT);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (atomic_load_explicit(&above->done, memory_order_acquire) < needed) {
+        if (spins < MAX_SPINS) {
+            for (i = 0; i < spins; i++)
+                cpu_relax();
+            spins <<= 1;
+        } else {
+            sched_yield();
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    ProfEnd(PROF_WAIT);
+
+    return elapsed_ms(&start, &stop);
+}
+
+void PipelineReset(RowProgress *progress, int rows) {
+    int i;
+
+    for (i = 0; i < rows; i++)
+        atomic_init(&progress[i].done, 0);
+}
+
+void *DitherPipelineTask(void *params) {
+    PipelineParam *p = (PipelineParam*)params;
+    int width = p->image.width, height = p->image.height;
+    int lag = p->serpentine ? width : p->lag;
+    int step = p->serpentine ? width : p->lag - KernelLag(p->kernel) + 1;
+    int r, x, x1, needed;
+
+    p->stall = 0;
+    for (r = p->id; r < height; r += p->num_threads) {
+        RGBTriple *row = p->image.pixels + (long)r * width;
+
+        for (x = 0; x < width; x = x1) {
+            x1 = x + step < width ? x + step : width;
+            if (r > 0) {
+                needed = x + lag < width ? x + lag : width;
+                p->stall += wait_for_row(&p->progress[r - 1], needed);
+            }
+            DitherSpan(p->kernel, row, width, height - 1 - r, x, x1, p->serpentine && (r & 1), p->palette,
+                       p->result + (long)r * width);
+            atomic_store_explicit(&p->progress[r].done, x1, memory_order_release);
+        }
+    }
+
+    return NULL;
+}
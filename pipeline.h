@@ -0,0 +1,40 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdatomic.h>
+
+#include "dither.h"
+
+// True error diffusion over rows shared between threads: thread id owns rows
+// id, id + num_threads, ... of one working copy and dithers each one in steps
+// of lag - KernelLag + 1 columns. Before a step it waits until the row above
+// is lag columns ahead, and after it publishes its own count for the row
+// below. In serpentine order a row needs the whole row above, so it waits for
+// all of it and dithers it in one step. floydT's pipeline mode and libdither
+// both run it.
+#define DEFAULT_LAG 64
+
+// columns completed in one row, padded so neighbouring rows (owned by
+// different threads) do not share a cache line
+typedef struct {
+    atomic_int done;
+    char pad[64 - sizeof(atomic_int)];
+} RowProgress;
+
+typedef struct {
+    int id, num_threads, lag, serpentine;   // lag at least KernelLag(kernel)
+    const DitherKernel *kernel;
+    RGBImage image;             // the working copy, shared by all threads
+    unsigned char *result;
+    RGBPalette palette;
+    RowProgress *progress;      // one per row, cleared by PipelineReset
+    double stall;               // ms this thread spent waiting on the row above
+} PipelineParam;
+
+void PipelineReset(RowProgress *progress, int rows);
+
+// the pthread start routine of one thread; every thread of a run has to be
+// running at once
+void *DitherPipelineTask(void *params);
+
+#endif
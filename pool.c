@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pool.h"
+
+typedef struct {
+    void *(*job)(void*);
+    void *arg;
+} PoolJob;
+
+struct ThreadPool {
+    int num_threads;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // signalled when a job is queued or on shutdown
+    pthread_cond_t idle;        // signalled when the last pending job finishes
+
+    PoolJob *queue;             // ring buffer of `capacity` jobs
+    int capacity, head, count;
+    PoolJob *owned;             // one slot per worker for PoolSubmitTo, job == NULL when free
+    pthread_cond_t taken;       // signalled when a worker empties its slot
+    int pending;                // queued plus running
+    int shutdown;
+};
+
+typedef struct {
+    ThreadPool *pool;
+    int id;
+} PoolWorker;
+
+// one id of a PoolRunWorkers call
+typedef struct {
+    WorkFunc work;
+    void *arg;
+    int id;
+} PoolRun;
+
+static ThreadPool *shared_pool;
+static int pin_offset;
+
+static void* pool_worker(void *params) {
+    ThreadPool *pool = ((PoolWorker*)params)->pool;
+    PoolJob *owned = &pool->owned[((PoolWorker*)params)->id];
+    PoolJob job;
+
+    free(params);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!owned->job && pool->count == 0 && !pool->shutdown)
+            pthread_cond_wait(&pool->work, &pool->lock);
+
+        if (owned->job) {
+            job = *owned;
+            owned->job = NULL;
+            pthread_cond_broadcast(&pool->taken);
+        } else if (pool->count > 0) {
+            job = pool->queue[pool->head];
+            pool->head = (pool->head + 1) % pool->capacity;
+            pool->count--;
+        } else {
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        job.job(job.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// worker i goes to CPU first + i of the process affinity mask, round-robin
+static void pin_worker(pthread_t thread, int first, int i) {
+#ifdef CPU_SET
+    cpu_set_t allowed, target;
+    int cpu, n = 0, count;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    count = CPU_COUNT(&allowed);
+    if (count <= 1)
+        return;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n++ == (first + i) % count) {
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            pthread_setaffinity_np(thread, sizeof(target), &target);
+            return;
+        }
+    }
+#endif
+}
+
+ThreadPool *PoolTryCreate(int num_threads, int pinFirst) {
+    ThreadPool *pool;
+    int i;
+
+    if (num_threads < 1)
+        num_threads = 1;
+
+    pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (!pool)
+        return NULL;
+    pool->threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    pool->capacity = 2 * num_threads;
+    pool->queue = (PoolJob*)malloc(pool->capacity * sizeof(PoolJob));
+    pool->owned = (PoolJob*)calloc(num_threads, sizeof(PoolJob));
+    if (!pool->threads || !pool->queue || !pool->owned) {
+        free(pool->threads);
+        free(pool->queue);
+        free(pool->owned);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pthread_cond_init(&pool->taken, NULL);
+
+    for (i = 0; i < num_threads; i++) {
+        PoolWorker *worker = (PoolWorker*)malloc(sizeof(PoolWorker));
+
+        if (worker) {
+            worker->pool = pool;
+            worker->id = i;
+        }
+        if (!worker || pthread_create(&pool->threads[i], NULL, &pool_worker, worker)) {
+            // stop the workers already running
+            free(worker);
+            pool->num_threads = i;
+            PoolDestroy(pool);
+            return NULL;
+        }
+        if (pinFirst >= 0)
+            pin_worker(pool->threads[i], pinFirst, i);
+    }
+    pool->num_threads = num_threads;
+
+    return pool;
+}
+
+void PoolPinOffset(int offset) {
+    pin_offset = offset;
+}
+
+ThreadPool *PoolCreate(int num_threads) {
+    const char *pin = getenv("DITHER_PIN");
+    ThreadPool *pool = PoolTryCreate(num_threads, pin && strcmp(pin, "1") == 0 ? pin_offset : -1);
+
+    if (!pool) {
+         fprintf(stderr, "Unable to start %d worker threads\n", num_threads);
+         exit(1);
+    }
+    return pool;
+}
+
+void PoolSubmit(ThreadPool *pool, void *(*job)(void*), void *arg) {
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->count == pool->capacity) {
+        PoolJob *queue = (PoolJob*)malloc(2 * pool->capacity * sizeof(PoolJob));
+        int i;
+
+        if (!queue) {
+             fprintf(stderr, "Unable to allocate memory\n");
+             exit(1);
+        }
+        for (i = 0; i < pool->count; i++)
+            queue[i] = pool->queue[(pool->head + i) % pool->capacity];
+        free(pool->queue);
+        pool->queue = queue;
+        pool->head = 0;
+        pool->capacity *= 2;
+    }
+
+    pool->queue[(pool->head + pool->count) % pool->capacity].job = job;
+    pool->queue[(pool->head + pool->count) % pool->capacity].arg = arg;
+    pool->count++;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void PoolSubmitTo(ThreadPool *pool, int worker, void *(*job)(void*), void *arg) {
+    PoolJob *owned = &pool->owned[worker % pool->num_threads];
+
+    pthread_mutex_lock(&pool->lock);
+    while (owned->job)
+        pthread_cond_wait(&pool->taken, &pool->lock);
+    owned->job = job;
+    owned->arg = arg;
+    pool->pending++;
+    // every worker sleeps on the same condition, so wake them all
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void PoolWait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void PoolDestroy(ThreadPool *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->num_threads; i++) {
+        if (pthread_join(pool->threads[i], NULL))
+            perror("pthread_join");
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->taken);
+    free(pool->threads);
+    free(pool->queue);
+    free(pool->owned);
+    free(pool);
+}
+
+ThreadPool *PoolShared(int num_threads) {
+    if (num_threads < 1)
+        num_threads = 1;
+    if (shared_pool && shared_pool->num_threads != num_threads)
+        PoolSharedDestroy();
+    if (!shared_pool)
+        shared_pool = PoolCreate(num_threads);
+    return shared_pool;
+}
+
+void PoolSharedDestroy(void) {
+    if (shared_pool) {
+        PoolDestroy(shared_pool);
+        shared_pool = NULL;
+    }
+}
+
+static void* pool_run(void *params) {
+    PoolRun *r = (PoolRun*)params;
+
+    r->work(r->arg, r->id);
+    return NULL;
+}
+
+void PoolRunWorkers(int workers, WorkFunc work, void *arg) {
+    ThreadPool *pool = PoolShared(workers);
+    PoolRun runs[workers];
+    int id;
+
+    for (id = 0; id < workers; id++) {
+        runs[id].work = work;
+        runs[id].arg = arg;
+        runs[id].id = id;
+        PoolSubmit(pool, &pool_run, &runs[id]);
+    }
+    PoolWait(pool);
+}
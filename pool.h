@@ -0,0 +1,41 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "dither.h"
+
+// A fixed set of worker threads fed from a FIFO job queue. Jobs have the
+// pthread start routine signature, so the existing *Task functions are
+// submitted unchanged; PoolWait returns once every submitted job finished.
+//
+// Workers float unless DITHER_PIN=1, which pins them round-robin to the CPUs
+// the process may run on. Jobs that wait on each other, like the pipeline
+// rows, need a pool with at least one worker per job.
+typedef struct ThreadPool ThreadPool;
+
+ThreadPool *PoolCreate(int num_threads);
+// pools created from now on pin their first worker `offset` CPUs into the
+// mask, so processes sharing a node (one per MPI rank) do not pin to the same
+// CPUs; 0 by default
+void PoolPinOffset(int offset);
+// for library callers: worker i is pinned to CPU pinFirst + i of the process
+// mask, or left floating when pinFirst is negative; NULL when the memory or
+// the threads cannot be had, without printing or exiting
+ThreadPool *PoolTryCreate(int num_threads, int pinFirst);
+void PoolSubmit(ThreadPool *pool, void *(*job)(void*), void *arg);
+void PoolWait(ThreadPool *pool);
+
+// runs the job on worker `worker` (modulo the pool size), ahead of the shared
+// queue, so a band always lands on the same pinned CPU; every worker holds at
+// most one such job and the call blocks while that slot is taken
+void PoolSubmitTo(ThreadPool *pool, int worker, void *(*job)(void*), void *arg);
+void PoolDestroy(ThreadPool *pool);
+
+// the process-wide pool, created on first use and rebuilt only when a
+// different number of threads is asked for
+ThreadPool *PoolShared(int num_threads);
+void PoolSharedDestroy(void);
+
+// RunWorkersFunc over the shared pool of `workers` threads
+void PoolRunWorkers(int workers, WorkFunc work, void *arg);
+
+#endif
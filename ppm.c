@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "ppm.h"
+#include "bench.h"
+
+// shared by the workers of writePal
+typedef struct {
+    const PalFile *file;
+    atomic_int next;
+} WriteWork;
+
+#define CREATOR "AlexBudau"
+#define RGB_COMPONENT_COLOR 255
+
+// the image handed out by mapPPM, with what munmap needs
+typedef struct {
+    RGBImage image;
+    void *base;
+    size_t length;
+} MappedImage;
+
+// skips whitespace and '#' comments, then reads a decimal field
+static int header_field(const unsigned char *data, size_t length, size_t *pos, int *value) {
+    while (*pos < length) {
+        if (data[*pos] == '#') {
+            while (*pos < length && data[*pos] != '\n')
+                (*pos)++;
+        } else if (isspace(data[*pos])) {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+
+    if (*pos == length || !isdigit(data[*pos]))
+        return 0;
+    for (*value = 0; *pos < length && isdigit(data[*pos]); (*pos)++) {
+        if (*value > 100000000)
+            return 0;
+        *value = *value * 10 + data[*pos] - '0';
+    }
+    return 1;
+}
+
+// checks the P6 header at `data` and returns where the pixels start
+static size_t parse_header(const char *filename, const unsigned char *data, size_t length, RGBImage *img) {
+    size_t pos;
+    int rgb_comp_color;
+
+    //check the image format
+    if (length < 2 || data[0] != 'P' || data[1] != '6') {
+         fprintf(stderr, "Invalid image format (must be 'P6')\n");
+         exit(1);
+    }
+
+    //read image size information
+    pos = 2;
+    if (!header_field(data, length, &pos, &img->width)
+        || !header_field(data, length, &pos, &img->height)) {
+         fprintf(stderr, "Invalid image size (error loading '%s')\n", filename);
+         exit(1);
+    }
+
+    //read rgb component
+    if (!header_field(data, length, &pos, &rgb_comp_color)) {
+         fprintf(stderr, "Invalid rgb component (error loading '%s')\n", filename);
+         exit(1);
+    }
+
+    //check rgb component depth
+    if (rgb_comp_color != RGB_COMPONENT_COLOR) {
+         fprintf(stderr, "'%s' does not have 8-bits components\n", filename);
+         exit(1);
+    }
+
+    // exactly one whitespace character separates the header from the body
+    if (pos == length || !isspace(data[pos])) {
+         fprintf(stderr, "Invalid image format (error loading '%s')\n", filename);
+         exit(1);
+    }
+    pos++;
+    if (img->width == 0
+        || (length - pos) / 3 / img->width < (size_t)img->height) {
+         fprintf(stderr, "Unable to load file\n");
+         exit(1);
+    }
+    return pos;
+}
+
+RGBImage *mapPPM(const char *filename) {
+    const char *mode = getenv("DITHER_MMAP");
+    MappedImage *img;
+    const unsigned char *data;
+    struct stat st;
+    int fd, flags;
+
+    //open PPM file for reading
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+         fprintf(stderr, "Unable to open file '%s'\n", filename);
+         exit(1);
+    }
+    if (fstat(fd, &st) < 0) {
+         perror(filename);
+         exit(1);
+    }
+    // mmap refuses an empty file, and no P6 header fits in less
+    if (st.st_size < 2) {
+         fprintf(stderr, "Invalid image format (must be 'P6')\n");
+         exit(1);
+    }
+
+    //alloc memory form image
+    img = (MappedImage *)malloc(sizeof(MappedImage));
+    if (!img) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (mode && strcmp(mode, "populate") == 0)
+        flags |= MAP_POPULATE;
+#endif
+    img->length = st.st_size;
+    img->base = mmap(NULL, img->length, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (img->base == MAP_FAILED) {
+         perror(filename);
+         exit(1);
+    }
+    close(fd);
+
+    if (mode && strcmp(mode, "sequential") == 0)
+        madvise(img->base, img->length, MADV_SEQUENTIAL);
+    else if (mode && strcmp(mode, "willneed") == 0)
+        madvise(img->base, img->length, MADV_WILLNEED);
+
+    data = (const unsigned char*)img->base;
+    img->image.pixels = (RGBTriple*)(data + parse_header(filename, data, img->length, &img->image));
+
+    return &img->image;
+}
+
+long readPPMHeader(const char *filename, RGBImage *img) {
+    struct stat st;
+    void *data;
+    long offset;
+    int fd;
+
+    //open PPM file for reading
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+         fprintf(stderr, "Unable to open file '%s'\n", filename);
+         exit(1);
+    }
+    if (fstat(fd, &st) < 0) {
+         perror(filename);
+         exit(1);
+    }
+    // mmap refuses an empty file, and no P6 header fits in less
+    if (st.st_size < 2) {
+         fprintf(stderr, "Invalid image format (must be 'P6')\n");
+         exit(1);
+    }
+
+    // only the pages holding the header are ever touched
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+         perror(filename);
+         exit(1);
+    }
+    close(fd);
+
+    offset = parse_header(filename, (const unsigned char*)data, st.st_size, img);
+    munmap(data, st.st_size);
+    img->pixels = NULL;
+
+    return offset;
+}
+
+RGBImage *readPPM(const char *filename) {
+	RGBImage *img;
+	FILE *fp;
+	long offset;
+
+    //alloc memory form image
+    img = (RGBImage *)malloc(sizeof(RGBImage));
+    if (!img) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    // the header goes through the same parser as mapPPM's, so its fields may
+    // share a line or sit on several, with comments anywhere between them
+    offset = readPPMHeader(filename, img);
+
+	//open PPM file for reading
+	fp = fopen(filename, "rb");
+	if (!fp) {
+	  fprintf(stderr, "Unable to open file '%s'\n", filename);
+	  exit(1);
+	}
+	if (fseek(fp, offset, SEEK_SET) != 0) {
+	  perror(filename);
+	  exit(1);
+	}
+
+    //memory allocation for pixel data
+    img->pixels = (RGBTriple*)malloc((long)img->width * img->height * sizeof(RGBTriple));
+
+    if (!img->pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    //read pixel data from file
+    
+    if ((fread(img->pixels, 3 * img->width, img->height , fp))!= img->height) {
+         fprintf(stderr, "Unable to load file\n");
+         exit(1);
+    }
+
+    fclose(fp);
+    return img;
+}
+
+void writePPM(const char *filename, RGBImage *img) {
+    FILE *fp;
+    //open file for output
+    fp = fopen(filename, "wb");
+    if (!fp) {
+         fprintf(stderr, "Unable to open file '%s'\n", filename);
+         exit(1);
+    }
+
+    //write the header file
+
+    //image format
+    fprintf(fp, "P6\n");
+
+    //comments
+    fprintf(fp, "# Created by %s\n",CREATOR);
+
+    //image size
+    fprintf(fp, "%d %d\n",img->width,img->height);
+
+    // rgb component depth
+    fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
+
+    // pixel data
+    fwrite(img->pixels, 3 * img->width, img->height, fp);
+    fclose(fp);
+}
+
+void unmapPPM(RGBImage *img) {
+    MappedImage *mapped = (MappedImage*)img;
+
+    munmap(mapped->base, mapped->length);
+    free(mapped);
+}
+
+void reportLoad(const struct timeval *start) {
+    const char *mode = getenv("DITHER_MMAP");
+    struct timeval stop;
+    struct rusage usage;
+    double elapsedTime;
+
+    gettimeofday(&stop, NULL);
+    getrusage(RUSAGE_SELF, &usage);
+
+    elapsedTime = (stop.tv_sec - start->tv_sec) * 1000.0;      // sec to ms
+    elapsedTime += (stop.tv_usec - start->tv_usec) / 1000.0;
+    if (getenv("DITHER_MPIIO"))
+        fprintf(stderr, "LOAD TIME = %lf (MPI-IO header), peak RSS = %ld KB\n", elapsedTime,
+                usage.ru_maxrss);
+    else
+        fprintf(stderr, "LOAD TIME = %lf (%s%s), peak RSS = %ld KB\n", elapsedTime,
+                mode ? "mmap " : "read", mode ? mode : "", usage.ru_maxrss);
+}
+
+static void put16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put32(unsigned char *p, unsigned long v) {
+    put16(p, v & 0xffff);
+    put16(p + 2, (v >> 16) & 0xffff);
+}
+
+static int output_format(RGBPalette palette) {
+    const char *format = getenv("DITHER_OUTPUT");
+
+    if (!format || strcmp(format, "ppm") == 0)
+        return OUTPUT_PPM;
+    if (strcmp(format, "bmp8") == 0)
+        return OUTPUT_BMP8;
+    if (strcmp(format, "bmp4") == 0 || strcmp(format, "bmp") == 0) {
+        if (palette.size <= 16)
+            return OUTPUT_BMP4;
+        if (strcmp(format, "bmp4") == 0)
+            fprintf(stderr, "%d colours do not fit in 4 bits, writing bmp8\n", palette.size);
+        return OUTPUT_BMP8;
+    }
+
+    fprintf(stderr, "Unknown output format '%s'\n", format);
+    exit(1);
+}
+
+PalFile describePal(const char *filename, RGBPalette palette, PalettizedImage result) {
+    PalFile file;
+    unsigned char *header = file.header;
+    const char *dot;
+    int i;
+
+    gettimeofday(&file.start, NULL);
+    file.format = output_format(palette);
+    file.palette = palette;
+    file.result = result;
+
+    if (file.format == OUTPUT_PPM) {
+        //format, comments, image size and rgb component depth
+        file.rowBytes = 3L * result.width;
+        file.offset = snprintf((char*)header, PAL_HEADER_MAX, "P6\n# Created by %s\n%d %d\n%d\n",
+                               CREATOR, result.width, result.height, RGB_COMPONENT_COLOR);
+        snprintf(file.name, sizeof(file.name), "%s", filename);
+    } else {
+        // BITMAPFILEHEADER, BITMAPINFOHEADER and the colour table; rows are
+        // stored bottom-up and padded to 4 bytes
+        int bits = file.format == OUTPUT_BMP4 ? 4 : 8;
+
+        file.rowBytes = (((long)result.width * bits + 31) / 32) * 4;
+        file.offset = 14 + 40 + 4 * palette.size;
+        memset(header, 0, file.offset);
+        header[0] = 'B';
+        header[1] = 'M';
+        put32(header + 2, file.offset + file.rowBytes * result.height);
+        put32(header + 10, file.offset);
+        put32(header + 14, 40);
+        put32(header + 18, result.width);
+        put32(header + 22, result.height);
+        put16(header + 26, 1);
+        put16(header + 28, bits);
+        put32(header + 34, file.rowBytes * result.height);
+        put32(header + 46, palette.size);
+        for (i = 0; i < palette.size; i++) {
+            header[54 + 4 * i] = palette.table[i].B;
+            header[54 + 4 * i + 1] = palette.table[i].G;
+            header[54 + 4 * i + 2] = palette.table[i].R;
+        }
+
+        dot = strrchr(filename, '.');
+        snprintf(file.name, sizeof(file.name), "%.*s.bmp", dot ? (int)(dot - filename) : (int)strlen(filename), filename);
+    }
+
+    file.fd = -1;
+
+    return file;
+}
+
+PalFile createPal(const char *filename, RGBPalette palette, PalettizedImage result) {
+    PalFile file = describePal(filename, palette, result);
+
+    //open file for output
+    file.fd = open(file.name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file.fd < 0) {
+         fprintf(stderr, "Unable to open file '%s'\n", file.name);
+         exit(1);
+    }
+    if (write(file.fd, file.header, file.offset) != file.offset) {
+         perror(file.name);
+         exit(1);
+    }
+
+    return file;
+}
+
+int palBandRows(const PalFile *file) {
+    int rows = WRITE_BUFFER_SIZE / file->rowBytes;
+
+    return rows > 0 ? rows : 1;
+}
+
+long expandPalRows(const PalFile *file, const unsigned char *index, int first, int last,
+                   unsigned char *buffer) {
+    PalettizedImage result = file->result;
+    const unsigned char *row;
+    unsigned char *out;
+    int x, y;
+
+    for (y = first; y < last; y++) {
+        row = index + (long)(y - first) * result.width;
+
+        if (file->format == OUTPUT_PPM) {
+            out = buffer + (y - first) * file->rowBytes;
+            for (x = 0; x < result.width; x++) {
+                RGBTriple color = file->palette.table[row[x]];
+
+                out[0] = color.R;
+                out[1] = color.G;
+                out[2] = color.B;
+                out += 3;
+            }
+        } else {
+            // bottom-up: the last row of the band comes first
+            out = buffer + (last - 1 - y) * file->rowBytes;
+            memset(out + file->rowBytes - 4, 0, 4);
+            if (file->format == OUTPUT_BMP8) {
+                memcpy(out, row, result.width);
+            } else {
+                for (x = 0; x + 1 < result.width; x += 2)
+                    out[x / 2] = (row[x] << 4) | row[x + 1];
+                if (x < result.width)
+                    out[x / 2] = row[x] << 4;
+            }
+        }
+    }
+
+    if (file->format == OUTPUT_PPM)
+        return file->offset + (long)first * file->rowBytes;
+    return file->offset + (long)(result.height - last) * file->rowBytes;
+}
+
+void writePalRows(const PalFile *file, int first, int last, unsigned char *buffer) {
+    size_t length = (last - first) * file->rowBytes, done;
+    ssize_t written;
+    long offset;
+
+    offset = expandPalRows(file, file->result.pixels + (long)first * file->result.width,
+                           first, last, buffer);
+    for (done = 0; done < length; done += written) {
+        written = pwrite(file->fd, buffer + done, length - done, offset + done);
+        if (written <= 0) {
+             perror("pwrite");
+             exit(1);
+        }
+    }
+}
+
+void closePal(PalFile *file) {
+    close(file->fd);
+    reportWrite(file);
+}
+
+void reportWrite(const PalFile *file) {
+    struct timeval stop;
+    double elapsedTime;
+    const char *format[] = {"ppm", "bmp8", "bmp4"};
+    long bytes = file->offset + file->rowBytes * file->result.height;
+
+    gettimeofday(&stop, NULL);
+
+    elapsedTime = (stop.tv_sec - file->start.tv_sec) * 1000.0;      // sec to ms
+    elapsedTime += (stop.tv_usec - file->start.tv_usec) / 1000.0;
+    if (!BenchRunning())
+        fprintf(stderr, "WRITE TIME = %lf (%s, %ld bytes, %.1lf MB/s)\n", elapsedTime,
+                format[file->format], bytes, bytes / (double)(1 << 20) / (elapsedTime / 1000.0));
+}
+
+static void write_work(void *arg, int id) {
+    WriteWork *w = (WriteWork*)arg;
+    int bandRows = palBandRows(w->file), height = w->file->result.height;
+    unsigned char *buffer = (unsigned char*)malloc(bandRows * w->file->rowBytes);
+    int first;
+
+    if (!buffer) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    while ((first = atomic_fetch_add(&w->next, bandRows)) < height)
+        writePalRows(w->file, first, first + bandRows < height ? first + bandRows : height, buffer);
+
+    free(buffer);
+}
+
+void writePal(const char *filename, RGBPalette palette, PalettizedImage result, int workers,
+              RunWorkersFunc run) {
+    PalFile file = createPal(filename, palette, result);
+    WriteWork w;
+
+    // every worker expands whole bands into its own buffer and writes them
+    w.file = &file;
+    atomic_init(&w.next, 0);
+    run(workers, &write_work, &w);
+
+    closePal(&file);
+}
+
+void writePalFile(const char *filename, RGBPalette palette, PalettizedImage result) {
+    writePal(filename, palette, result, 1, RunWorkersSerial);
+}
@@ -0,0 +1,83 @@
+#ifndef PPM_H
+#define PPM_H
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "dither.h"
+
+// reads a whole P6 file into memory, and writes one back (CREATOR comment)
+RGBImage *readPPM(const char *filename);
+void writePPM(const char *filename, RGBImage *img);
+
+// Maps a P6 file and returns an image whose pixels point straight into the
+// mapping, so the body is never copied. The mapping is private and writable:
+// a variant that writes into the pixels only copies the pages it touches.
+//
+// DITHER_MMAP picks the flavour: "populate" prefaults the whole file with
+// MAP_POPULATE, "sequential" and "willneed" pass that madvise hint, and any
+// other value maps it lazily.
+RGBImage *mapPPM(const char *filename);
+void unmapPPM(RGBImage *img);
+
+// parses only the header: fills width and height, leaves pixels NULL and
+// returns the offset of the pixel data in the file
+long readPPMHeader(const char *filename, RGBImage *img);
+
+// Palettized output goes through big pwrite calls instead of one fwrite per
+// pixel. createPal writes the header; writePalRows expands rows [first, last)
+// into `buffer` (palBandRows * rowBytes bytes) and writes them at their own
+// offset, so threads can write disjoint bands at the same time. closePal
+// reports MB/s.
+//
+// DITHER_OUTPUT picks the format: "ppm" (default) expands the indices to
+// 24-bit P6, "bmp8" keeps the index plane and the palette in an 8-bit indexed
+// BMP, "bmp4" packs two indices per byte when the palette has at most 16
+// colours, and "bmp" takes the smaller of the two. BMP output replaces the
+// .ppm extension of the file name.
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+#define OUTPUT_PPM 0
+#define OUTPUT_BMP8 1
+#define OUTPUT_BMP4 2
+
+// BMP file header, info header and a full colour table
+#define PAL_HEADER_MAX (14 + 40 + 4 * 256)
+
+typedef struct {
+    int fd, format;
+    long offset, rowBytes;
+    RGBPalette palette;
+    PalettizedImage result;
+    struct timeval start;
+    unsigned char header[PAL_HEADER_MAX];
+    char name[FILENAME_MAX];
+} PalFile;
+
+PalFile createPal(const char *filename, RGBPalette palette, PalettizedImage result);
+int palBandRows(const PalFile *file);
+void writePalRows(const PalFile *file, int first, int last, unsigned char *buffer);
+void closePal(PalFile *file);
+
+// the whole result through createPal/writePalRows/closePal, the bands handed
+// to whichever worker is free, each with its own buffer
+void writePal(const char *filename, RGBPalette palette, PalettizedImage result, int workers,
+              RunWorkersFunc run);
+
+// writePal on the calling thread
+void writePalFile(const char *filename, RGBPalette palette, PalettizedImage result);
+
+// The pieces createPal and writePalRows are made of, for writers that do
+// their own I/O: describePal fills in the header, the file name and the row
+// layout without opening anything, and expandPalRows expands rows
+// [first, last), whose indices start at `index`, into `buffer` and returns
+// the file offset the buffer belongs at.
+PalFile describePal(const char *filename, RGBPalette palette, PalettizedImage result);
+long expandPalRows(const PalFile *file, const unsigned char *index, int first, int last,
+                   unsigned char *buffer);
+void reportWrite(const PalFile *file);
+
+// prints the time since `start` and the peak RSS so far on stderr
+void reportLoad(const struct timeval *start);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <mpi.h>
+
+#include "ppm.h"
+#include "ppm_mpi.h"
+#include "bench.h"
+
+static MPI_File input = MPI_FILE_NULL;
+static long input_offset;
+
+RGBImage *readPPMRoot(const char *filename, int proc_num) {
+    RGBImage *img;
+
+    if (proc_num == 0)
+        return readPPM(filename);
+
+    img = (RGBImage *)calloc(1, sizeof(RGBImage));
+    if (!img) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    return img;
+}
+
+RGBImage *openPPMAll(const char *filename, int proc_num) {
+    RGBImage *img;
+    int size[2];
+
+    //alloc memory form image
+    img = (RGBImage *)malloc(sizeof(RGBImage));
+    if (!img) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    if (proc_num == 0) {
+        input_offset = readPPMHeader(filename, img);
+        size[0] = img->width;
+        size[1] = img->height;
+    }
+    MPI_Bcast(size, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&input_offset, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+    img->width = size[0];
+    img->height = size[1];
+    img->pixels = NULL;
+
+    if (MPI_File_open(MPI_COMM_WORLD, (char*)filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &input)
+        != MPI_SUCCESS) {
+         fprintf(stderr, "Unable to open file '%s'\n", filename);
+         exit(1);
+    }
+
+    return img;
+}
+
+void closePPMAll(void) {
+    if (input != MPI_FILE_NULL)
+        MPI_File_close(&input);
+}
+
+void scatterPPM(const RGBTriple *pixels, const int *counts, const int *displs,
+                void *band, int proc_num) {
+    MPI_Status status;
+
+    if (input == MPI_FILE_NULL) {
+        BenchBegin("communicate");
+        MPI_Scatterv((void*)pixels, (int*)counts, (int*)displs, MPI_UNSIGNED_CHAR,
+                     band, counts[proc_num], MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        BenchEnd();
+        return;
+    }
+
+    BenchBegin("read");
+    MPI_File_read_at_all(input, input_offset + displs[proc_num], band, counts[proc_num],
+                         MPI_UNSIGNED_CHAR, &status);
+    BenchEnd();
+}
+
+void iscatterPPM(const RGBTriple *pixels, const int *counts, const int *displs,
+                 void *band, int proc_num, MPI_Request *request) {
+    if (input == MPI_FILE_NULL)
+        MPI_Iscatterv((void*)pixels, (int*)counts, (int*)displs, MPI_UNSIGNED_CHAR,
+                      band, counts[proc_num], MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD, request);
+    else
+        MPI_File_iread_at_all(input, input_offset + displs[proc_num], band, counts[proc_num],
+                              MPI_UNSIGNED_CHAR, request);
+}
+
+void writePalAll(const char *filename, RGBPalette palette, int width, int height,
+                 const unsigned char *band, int first, int rows, int proc_num) {
+    PalettizedImage result;
+    PalFile file;
+    MPI_File output;
+    MPI_Status status;
+    unsigned char *buffer;
+    long offset;
+
+    BenchBegin("write");
+    result.width = width;
+    result.height = height;
+    result.pixels = NULL;
+    file = describePal(filename, palette, result);
+
+    buffer = (unsigned char*)malloc(rows * file.rowBytes + 1);
+    if (!buffer) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    offset = expandPalRows(&file, band, first, first + rows, buffer);
+
+    if (MPI_File_open(MPI_COMM_WORLD, file.name, MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                      MPI_INFO_NULL, &output) != MPI_SUCCESS) {
+         fprintf(stderr, "Unable to open file '%s'\n", file.name);
+         exit(1);
+    }
+    // drops whatever a longer earlier output left behind
+    MPI_File_set_size(output, file.offset + file.rowBytes * height);
+
+    if (proc_num == 0)
+        MPI_File_write_at(output, 0, file.header, file.offset, MPI_UNSIGNED_CHAR, &status);
+    MPI_File_write_at_all(output, offset, buffer, rows * file.rowBytes, MPI_UNSIGNED_CHAR, &status);
+
+    MPI_File_close(&output);
+    free(buffer);
+
+    if (proc_num == 0)
+        reportWrite(&file);
+    BenchEnd();
+}
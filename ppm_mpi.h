@@ -0,0 +1,37 @@
+#ifndef PPM_MPI_H
+#define PPM_MPI_H
+
+#include <mpi.h>
+
+#include "dither.h"
+
+// rank 0 reads the whole file with readPPM; the other ranks get an image
+// without pixels, whose size rank 0 broadcasts afterwards
+RGBImage *readPPMRoot(const char *filename, int proc_num);
+
+// MPI-IO input (DITHER_MPIIO): rank 0 parses only the header and broadcasts
+// the size and the offset of the pixel data, then every rank reads its own
+// rows with MPI_File_read_at_all, so rank 0 never holds the whole image.
+// openPPMAll is collective and returns an image without pixels on every rank.
+RGBImage *openPPMAll(const char *filename, int proc_num);
+void closePPMAll(void);
+
+// Hands every rank its part of the image, counts and displs being in bytes as
+// for MPI_Scatterv: read from the file when it was opened with openPPMAll,
+// scattered from rank 0's pixels otherwise.
+void scatterPPM(const RGBTriple *pixels, const int *counts, const int *displs,
+                void *band, int proc_num);
+
+// scatterPPM without waiting: MPI_Iscatterv, or MPI_File_iread_at_all from
+// the file opened with openPPMAll; the part has arrived once `request` is done
+void iscatterPPM(const RGBTriple *pixels, const int *counts, const int *displs,
+                 void *band, int proc_num, MPI_Request *request);
+
+// Collective write of the result (DITHER_MPIIO): every rank expands its own
+// rows [first, first + rows), whose indices are in `band`, and writes them at
+// their offset with MPI_File_write_at_all; rank 0 also writes the header.
+// Nothing is gathered on rank 0.
+void writePalAll(const char *filename, RGBPalette palette, int width, int height,
+                 const unsigned char *band, int first, int rows, int proc_num);
+
+#endif
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "palette_search.h"
+#include "prof.h"
+
+#define PROF_COUNTERS 3
+#define CALIBRATION_ROUNDS 1000
+
+typedef struct ProfThread {
+    double ms[PROF_REGIONS];
+    int stack[PROF_MAX_DEPTH], depth;
+    struct timespec since;          // when the region on top last resumed
+
+    long searchCalls, sampledCalls;
+    double sampledNs;
+
+    int counters[PROF_COUNTERS];    // perf fds, -1 when unavailable
+    int id;                         // in order of the first region
+    struct ProfThread *next;
+} ProfThread;
+
+int prof_enabled;
+
+static double clock_overhead_ns;
+static ProfThread *threads, **threads_tail = &threads;
+static int num_threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local ProfThread *self;
+
+static double ns_between(const struct timespec *start, const struct timespec *stop) {
+    return (stop->tv_sec - start->tv_sec) * 1e9 + (stop->tv_nsec - start->tv_nsec);
+}
+
+void ProfStart(void) {
+    struct timespec start, stop;
+    double best = 1e9;
+    int i;
+
+    prof_enabled = getenv("DITHER_PROF") && strcmp(getenv("DITHER_PROF"), "0") != 0;
+    if (!prof_enabled)
+        return;
+
+    // the cheapest back-to-back pair is what every sample pays for nothing
+    for (i = 0; i < CALIBRATION_ROUNDS; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        if (ns_between(&start, &stop) < best)
+            best = ns_between(&start, &stop);
+    }
+    clock_overhead_ns = best;
+}
+
+static int open_counter(unsigned long config, int group) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static ProfThread *this_thread(void) {
+    static const unsigned long configs[PROF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    int i;
+
+    if (self)
+        return self;
+
+    self = (ProfThread*)calloc(1, sizeof(ProfThread));
+    if (!self) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    for (i = 0; i < PROF_COUNTERS; i++)
+        self->counters[i] = open_counter(configs[i], -1);
+
+    pthread_mutex_lock(&threads_lock);
+    self->id = num_threads++;
+    *threads_tail = self;
+    threads_tail = &self->next;
+    pthread_mutex_unlock(&threads_lock);
+
+    return self;
+}
+
+void ProfBegin(int region) {
+    ProfThread *t;
+    struct timespec now;
+
+    if (!prof_enabled)
+        return;
+    t = this_thread();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (t->depth == PROF_MAX_DEPTH) {
+         fprintf(stderr, "Profile regions nested too deep\n");
+         exit(1);
+    }
+
+    // the enclosing region stops counting while this one runs
+    if (t->depth > 0)
+        t->ms[t->stack[t->depth - 1]] += ns_between(&t->since, &now) / 1e6;
+    t->stack[t->depth++] = region;
+    t->since = now;
+}
+
+void ProfEnd(int region) {
+    ProfThread *t = self;
+    struct timespec now;
+
+    if (!prof_enabled || !t || t->depth == 0)
+        return;
+    // regions close in the order they were opened
+    assert(t->stack[t->depth - 1] == region);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t->ms[t->stack[--t->depth]] += ns_between(&t->since, &now) / 1e6;
+    t->since = now;
+}
+
+unsigned char ProfFindNearestColor(RGBTriple color, RGBPalette palette) {
+    ProfThread *t = this_thread();
+    struct timespec start, stop;
+    unsigned char index;
+
+    if (t->searchCalls++ % PROF_SAMPLE_EVERY)
+        return palette.search->find(palette.search, color);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    index = palette.search->find(palette.search, color);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    t->sampledNs += ns_between(&start, &stop) - clock_overhead_ns;
+    t->sampledCalls++;
+
+    return index;
+}
+
+void ProfReport(const char *backend, int rank) {
+    ProfThread *t;
+    double search, diffuse;
+    long long count[PROF_COUNTERS];
+    int valid[PROF_COUNTERS], i;
+    char *table;
+    size_t length;
+    FILE *out;
+
+    if (!prof_enabled)
+        return;
+
+    // built first and written in one go, so the tables of several ranks
+    // sharing stderr do not interleave
+    out = open_memstream(&table, &length);
+    if (!out) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+    if (rank >= 0)
+        fprintf(out, "PROFILE %s rank %d\n", backend, rank);
+    else
+        fprintf(out, "PROFILE %s\n", backend);
+    fprintf(out, "%-8s %10s %10s %10s %10s %14s %14s %12s %6s\n", "thread", "search ms", "diffuse ms",
+            "wait ms", "mpi ms", "cycles", "instructions", "llc misses", "ipc");
+
+    pthread_mutex_lock(&threads_lock);
+    for (t = threads; t; t = t->next) {
+        search = t->sampledCalls ? t->sampledNs / t->sampledCalls * t->searchCalls / 1e6 : 0;
+        if (search > t->ms[PROF_KERNEL])
+            search = t->ms[PROF_KERNEL];
+        if (search < 0)
+            search = 0;
+        diffuse = t->ms[PROF_KERNEL] - search;
+
+        fprintf(out, "%-8d %10.3lf %10.3lf %10.3lf %10.3lf",
+                t->id, search, diffuse, t->ms[PROF_WAIT], t->ms[PROF_MPI]);
+        for (i = 0; i < PROF_COUNTERS; i++) {
+            valid[i] = t->counters[i] >= 0 && read(t->counters[i], &count[i], sizeof(count[i])) == sizeof(count[i]);
+            if (valid[i])
+                fprintf(out, " %*lld", i == 2 ? 12 : 14, count[i]);
+            else
+                fprintf(out, " %*s", i == 2 ? 12 : 14, "n/a");
+        }
+        if (valid[0] && valid[1] && count[0] > 0)
+            fprintf(out, " %6.2lf\n", (double)count[1] / count[0]);
+        else
+            fprintf(out, " %6s\n", "n/a");
+
+        memset(t->ms, 0, sizeof(t->ms));
+        t->searchCalls = t->sampledCalls = 0;
+        t->sampledNs = 0;
+        for (i = 0; i < PROF_COUNTERS; i++) {
+            if (t->counters[i] >= 0)
+                ioctl(t->counters[i], PERF_EVENT_IOC_RESET, 0);
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    // stderr, so run.sh still only sees the TIME line
+    fclose(out);
+    fputs(table, stderr);
+    free(table);
+}
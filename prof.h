@@ -0,0 +1,48 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include "dither.h"
+
+// Hot-path profile (DITHER_PROF=1), kept per thread and printed per rank.
+// Threads mark the regions they spend time in:
+//
+//   PROF_KERNEL   dithering: the nearest-colour search plus the diffusion
+//   PROF_WAIT     waiting on other threads (barriers, row progress)
+//   PROF_MPI      inside MPI calls, marked by the PMPI wrappers of prof_mpi.c
+//
+// Regions nest, and a region's time excludes the regions opened inside it.
+// Timing the search on every pixel would cost as much as the search, so
+// FindNearestColor times one call in PROF_SAMPLE_EVERY; the sampled mean,
+// less the clock's own overhead, times the number of calls gives the search
+// time, and the rest of PROF_KERNEL is the diffusion.
+//
+// Where perf_event_open is allowed, every thread also counts its user-mode
+// cycles, instructions and last-level cache misses from its first region on
+// (waits included); the columns read n/a otherwise.
+#define PROF_KERNEL 0
+#define PROF_WAIT 1
+#define PROF_MPI 2
+#define PROF_REGIONS 3
+
+#define PROF_SAMPLE_EVERY 32
+#define PROF_MAX_DEPTH 8
+
+// set once by ProfStart, before any thread is started
+extern int prof_enabled;
+
+// reads DITHER_PROF and calibrates the clock
+void ProfStart(void);
+
+void ProfBegin(int region);
+// closes `region`, which has to be the innermost one still open
+void ProfEnd(int region);
+
+// FindNearestColor with the sampled timing, used while profiling
+unsigned char ProfFindNearestColor(RGBTriple color, RGBPalette palette);
+
+// prints one line per thread that marked a region since the last report
+// (DITHER_REPEAT runs included), then clears the counts;
+// rank is -1 outside MPI
+void ProfReport(const char *backend, int rank);
+
+#endif
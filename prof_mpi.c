@@ -0,0 +1,132 @@
+#include <mpi.h>
+
+#include "prof.h"
+
+// PMPI wrappers: every communication and MPI-IO call the backends make counts
+// as PROF_MPI time, without touching the call sites. Setup and local queries
+// (MPI_Init*, MPI_Finalize, MPI_Comm_rank/size/split_type/free, MPI_Wtime,
+// MPI_Abort) are left alone. Linked into the MPI binaries only.
+#define prof_mpi(call) \
+    int ret; \
+    ProfBegin(PROF_MPI); \
+    ret = call; \
+    ProfEnd(PROF_MPI); \
+    return ret;
+
+int MPI_Scatterv(const void *sendbuf, const int sendcounts[], const int displs[], MPI_Datatype sendtype,
+                 void *recvbuf, int recvcount, MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    prof_mpi(PMPI_Scatterv(sendbuf, sendcounts, displs, sendtype, recvbuf, recvcount, recvtype, root, comm));
+}
+
+int MPI_Iscatterv(const void *sendbuf, const int sendcounts[], const int displs[], MPI_Datatype sendtype,
+                  void *recvbuf, int recvcount, MPI_Datatype recvtype, int root, MPI_Comm comm,
+                  MPI_Request *request) {
+    prof_mpi(PMPI_Iscatterv(sendbuf, sendcounts, displs, sendtype, recvbuf, recvcount, recvtype, root, comm,
+                            request));
+}
+
+int MPI_Scatter(const void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf, int recvcount,
+                MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    prof_mpi(PMPI_Scatter(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm));
+}
+
+int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf, int recvcount,
+               MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    prof_mpi(PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm));
+}
+
+int MPI_Gatherv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf,
+                const int recvcounts[], const int displs[], MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    prof_mpi(PMPI_Gatherv(sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs, recvtype, root, comm));
+}
+
+int MPI_Igatherv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf,
+                 const int recvcounts[], const int displs[], MPI_Datatype recvtype, int root, MPI_Comm comm,
+                 MPI_Request *request) {
+    prof_mpi(PMPI_Igatherv(sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs, recvtype, root, comm,
+                           request));
+}
+
+int MPI_Allgatherv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf,
+                   const int recvcounts[], const int displs[], MPI_Datatype recvtype, MPI_Comm comm) {
+    prof_mpi(PMPI_Allgatherv(sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs, recvtype, comm));
+}
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root, MPI_Comm comm) {
+    prof_mpi(PMPI_Bcast(buffer, count, datatype, root, comm));
+}
+
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, int root,
+               MPI_Comm comm) {
+    prof_mpi(PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm));
+}
+
+int MPI_Barrier(MPI_Comm comm) {
+    prof_mpi(PMPI_Barrier(comm));
+}
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm) {
+    prof_mpi(PMPI_Send(buf, count, datatype, dest, tag, comm));
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm,
+             MPI_Status *status) {
+    prof_mpi(PMPI_Recv(buf, count, datatype, source, tag, comm, status));
+}
+
+int MPI_Sendrecv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, int dest, int sendtag,
+                 void *recvbuf, int recvcount, MPI_Datatype recvtype, int source, int recvtag,
+                 MPI_Comm comm, MPI_Status *status) {
+    prof_mpi(PMPI_Sendrecv(sendbuf, sendcount, sendtype, dest, sendtag, recvbuf, recvcount, recvtype,
+                           source, recvtag, comm, status));
+}
+
+int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm,
+              MPI_Request *request) {
+    prof_mpi(PMPI_Isend(buf, count, datatype, dest, tag, comm, request));
+}
+
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm,
+              MPI_Request *request) {
+    prof_mpi(PMPI_Irecv(buf, count, datatype, source, tag, comm, request));
+}
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status) {
+    prof_mpi(PMPI_Wait(request, status));
+}
+
+int MPI_Waitall(int count, MPI_Request array_of_requests[], MPI_Status *array_of_statuses) {
+    prof_mpi(PMPI_Waitall(count, array_of_requests, array_of_statuses));
+}
+
+int MPI_File_open(MPI_Comm comm, const char *filename, int amode, MPI_Info info, MPI_File *fh) {
+    prof_mpi(PMPI_File_open(comm, filename, amode, info, fh));
+}
+
+int MPI_File_set_size(MPI_File fh, MPI_Offset size) {
+    prof_mpi(PMPI_File_set_size(fh, size));
+}
+
+int MPI_File_close(MPI_File *fh) {
+    prof_mpi(PMPI_File_close(fh));
+}
+
+int MPI_File_read_at_all(MPI_File fh, MPI_Offset offset, void *buf, int count, MPI_Datatype datatype,
+                         MPI_Status *status) {
+    prof_mpi(PMPI_File_read_at_all(fh, offset, buf, count, datatype, status));
+}
+
+int MPI_File_iread_at_all(MPI_File fh, MPI_Offset offset, void *buf, int count, MPI_Datatype datatype,
+                          MPI_Request *request) {
+    prof_mpi(PMPI_File_iread_at_all(fh, offset, buf, count, datatype, request));
+}
+
+int MPI_File_write_at_all(MPI_File fh, MPI_Offset offset, const void *buf, int count, MPI_Datatype datatype,
+                          MPI_Status *status) {
+    prof_mpi(PMPI_File_write_at_all(fh, offset, buf, count, datatype, status));
+}
+
+int MPI_File_write_at(MPI_File fh, MPI_Offset offset, const void *buf, int count, MPI_Datatype datatype,
+                      MPI_Status *status) {
+    prof_mpi(PMPI_File_write_at(fh, offset, buf, count, datatype, status));
+}
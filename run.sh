@@ -11,12 +11,26 @@ out_mpi="MPI.txt"
 out_threads="Threads.txt"
 out_mpi_omp="MPI_OpenMP.txt"
 out_mpi_threads="MPI_Threads.txt"
+out_wavefront="Wavefront.txt"
+out_openmp_tasks="OpenMP_Tasks.txt"
+out_threads_pipeline="Threads_Pipeline.txt"
+out_mpi_pipeline="MPI_Pipeline.txt"
+out_mpi_overlap="MPI_Overlap.txt"
+out_threads_steal="Threads_Steal.txt"
+out_numa="NUMA.txt"
 
 rm $out_openmp
 rm $out_mpi
 rm $out_threads
 rm $out_mpi_omp
 rm $out_mpi_threads
+rm $out_wavefront
+rm $out_openmp_tasks
+rm $out_threads_pipeline
+rm $out_mpi_pipeline
+rm $out_mpi_overlap
+rm $out_threads_steal
+rm $out_numa
 
 for t in 1 2 4 8;
 do
@@ -93,6 +107,122 @@ do
 done
 echo "$out_mpi_threads finished"
 
+for t in 1 2 4 8;
+do
+	export OMP_NUM_THREADS=$t
+	let "OUTPUT=0"
+	for i in `seq 1 $N`;
+    do
+       TIME=`./floydWF $FILE| awk '{ print $4 }'`
+       OUTPUT=`echo $OUTPUT+$TIME | bc`
+    done
+    OUTPUT=`echo "scale=4; $OUTPUT/$N" | bc -l`
+    echo "$t threads : $OUTPUT" >> $out_wavefront
+done
+echo "$out_wavefront finished"
+
+for t in 1 2 4 8;
+do
+	export OMP_NUM_THREADS=$t
+	let "OUTPUT=0"
+	for i in `seq 1 $N`;
+    do
+       TIME=`./floydOMP $FILE tasks| awk '{ print $4 }'`
+       OUTPUT=`echo $OUTPUT+$TIME | bc`
+    done
+    OUTPUT=`echo "scale=4; $OUTPUT/$N" | bc -l`
+    echo "$t threads : $OUTPUT" >> $out_openmp_tasks
+done
+echo "$out_openmp_tasks finished"
+
+for t in 1 2 4 8;
+do
+	let "OUTPUT=0"
+	for i in `seq 1 $N`;
+    do
+       TIME=`./floydT $t $FILE pipeline 2>/dev/null| awk '{ print $4 }'`
+       OUTPUT=`echo $OUTPUT+$TIME | bc`
+    done
+    OUTPUT=`echo "scale=4; $OUTPUT/$N" | bc -l`
+    echo "$t threads : $OUTPUT" >> $out_threads_pipeline
+done
+echo "$out_threads_pipeline finished"
+
+for t in 1 2 4 8;
+do
+	let "OUTPUT=0"
+	for i in `seq 1 $N`;
+    do
+       TIME=`mpirun -n $t floydMPI $FILE pipeline 2>/dev/null| awk '{ print $4 }'`
+       OUTPUT=`echo $OUTPUT+$TIME | bc`
+    done
+    OUTPUT=`echo "scale=4; $OUTPUT/$N" | bc -l`
+    echo "$t processes : $OUTPUT" >> $out_mpi_pipeline
+done
+echo "$out_mpi_pipeline finished"
+
+for t in 1 2 4 8;
+do
+	let "OUTPUT=0"
+	for i in `seq 1 $N`;
+    do
+       TIME=`mpirun -n $t floydMPI $FILE overlap 2>/dev/null| awk '{ print $4 }'`
+       OUTPUT=`echo $OUTPUT+$TIME | bc`
+    done
+    OUTPUT=`echo "scale=4; $OUTPUT/$N" | bc -l`
+    echo "$t processes : $OUTPUT" >> $out_mpi_overlap
+done
+echo "$out_mpi_overlap finished"
+
+# static tiles against stolen ones, with the first quarter of the tiles slowed
+# down so that a static split leaves most threads idle
+export DITHER_IMBALANCE=2000
+for s in 0 1;
+do
+	echo "DITHER_STEAL=$s: " >> $out_threads_steal
+	for t in 1 2 4 8;
+	do
+		let "OUTPUT=0"
+		for i in `seq 1 $N`;
+	    do
+	       TIME=`DITHER_STEAL=$s ./floydT $t $FILE steal 2>/dev/null| awk '{ print $4 }'`
+	       OUTPUT=`echo $OUTPUT+$TIME | bc`
+	    done
+	    OUTPUT=`echo "scale=4; $OUTPUT/$N" | bc -l`
+	    echo -e "\t $t threads : $OUTPUT" >> $out_threads_steal
+	done
+done
+unset DITHER_IMBALANCE
+echo "$out_threads_steal finished"
+
+# the old layout (image touched by the main thread, floating threads) against
+# pinned workers that first-touch their own bands; only differs on NUMA boxes
+for t in 8 16;
+do
+	echo "$t threads: " >> $out_numa
+	for layout in main local;
+	do
+		let "OUTPUT=0"
+		let "OUTPUT_OMP=0"
+		for i in `seq 1 $N`;
+	    do
+	       if [ $layout == local ]; then
+	           TIME=`DITHER_NUMA=local DITHER_PIN=1 ./floydT $t $FILE 2>/dev/null| awk '{ print $4 }'`
+	           TIME_OMP=`DITHER_NUMA=local OMP_NUM_THREADS=$t OMP_PLACES=cores OMP_PROC_BIND=close ./floydOMP $FILE 2>/dev/null| awk '{ print $4 }'`
+	       else
+	           TIME=`./floydT $t $FILE 2>/dev/null| awk '{ print $4 }'`
+	           TIME_OMP=`OMP_NUM_THREADS=$t ./floydOMP $FILE 2>/dev/null| awk '{ print $4 }'`
+	       fi
+	       OUTPUT=`echo $OUTPUT+$TIME | bc`
+	       OUTPUT_OMP=`echo $OUTPUT_OMP+$TIME_OMP | bc`
+	    done
+	    OUTPUT=`echo "scale=4; $OUTPUT/$N" | bc -l`
+	    OUTPUT_OMP=`echo "scale=4; $OUTPUT_OMP/$N" | bc -l`
+	    echo -e "\t $layout : threads $OUTPUT openmp $OUTPUT_OMP" >> $out_numa
+	done
+done
+echo "$out_numa finished"
+
 cat $out_openmp
 echo " "
 cat $out_mpi
@@ -101,4 +231,18 @@ cat $out_threads
 echo " "
 cat $out_mpi_omp
 echo " "
-cat $out_mpi_threads
\ No newline at end of file
+cat $out_mpi_threads
+echo " "
+cat $out_wavefront
+echo " "
+cat $out_openmp_tasks
+echo " "
+cat $out_threads_pipeline
+echo " "
+cat $out_mpi_pipeline
+echo " "
+cat $out_mpi_overlap
+echo " "
+cat $out_threads_steal
+echo " "
+cat $out_numa
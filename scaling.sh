@@ -0,0 +1,154 @@
+#!/bin/bash
+# ./scaling.sh [strong|weak|both] [image.ppm] [iterations]
+# Sweeps the backends of the floyd driver over worker counts (threads, ranks,
+# and every ranks x threads split of the same count for the hybrids).
+#   strong: one image, ./images/<image.ppm> or a synthetic STRONG_SIZE one
+#   weak:   a synthetic image of WEAK_SIZE per worker, grown in rows
+# Every configuration is timed by its own benchmark mode (see bench.h): the
+# median compute plus communicate time, so reading and writing the image are
+# left out. Against the same backend on one worker (T_1, on n_1 pixels) it gets
+#   speedup S = T_1 * (n_p / n_1) / T_p       (scaled speedup when weak)
+#   efficiency E = S / p
+#   Karp-Flatt serial fraction e = (1/S - 1/p) / (1 - 1/p)
+# plus T_serial / T_p against the serial backend on the same image. Rows are
+# appended to scaling.csv; the fastest configuration and the fastest one with
+# E >= MIN_EFFICIENCY are printed per study.
+
+make floyd synth
+
+STUDY=${1:-both}
+DIR="./images/"
+N=${3:-5}
+WORKERS=${WORKERS:-"1 2 4 8"}
+STRONG_SIZE=${STRONG_SIZE:-2048x2048}
+WEAK_SIZE=${WEAK_SIZE:-2048x256}
+MIN_EFFICIENCY=${MIN_EFFICIENCY:-0.7}
+MPIRUN=${MPIRUN:-mpirun}
+out_scaling="scaling.csv"
+
+TMP=`mktemp -d`
+trap "rm -rf $TMP" EXIT
+export DITHER_BENCH="$N,1"
+export DITHER_BENCH_OUT=$TMP/bench.csv
+
+# run study ranks threads width height command...
+run() {
+	export OMP_NUM_THREADS=$3
+	export DITHER_BENCH_LABEL="$1:$2:$3:$4:$5"
+	shift 5
+	if ! "$@" > /dev/null 2> $TMP/log; then
+		echo "failed: $*"
+		tail -5 $TMP/log
+	fi
+}
+
+# every configuration with p workers in total on one image
+configs() {
+	local study=$1 p=$2 file=$3 w=$4 h=$5 r
+	run $study 1 $p $w $h ./floyd --backend=omp $file
+	run $study 1 $p $w $h ./floyd --backend=omp $file tasks
+	run $study 1 $p $w $h ./floyd --backend=wavefront $file
+	run $study 1 $p $w $h ./floyd --backend=pthreads $p $file
+	run $study 1 $p $w $h ./floyd --backend=pthreads $p $file pipeline
+	run $study $p 1 $w $h $MPIRUN -n $p ./floyd --backend=mpi $file
+	run $study $p 1 $w $h $MPIRUN -n $p ./floyd --backend=mpi $file pipeline
+	for r in $WORKERS; do
+		if [ $p -eq 1 ] && [ $r -eq 1 ]; then
+			# the hybrids' own one-worker baseline
+			run $study 1 1 $w $h $MPIRUN -n 1 ./floyd --backend=mpi+omp $file
+			run $study 1 1 $w $h $MPIRUN -n 1 ./floyd --backend=mpi+threads 1 $file
+		elif [ $r -gt 1 ] && [ $r -lt $p ] && [ $((p % r)) -eq 0 ]; then
+			run $study $r $((p / r)) $w $h $MPIRUN -n $r ./floyd --backend=mpi+omp $file
+			run $study $r $((p / r)) $w $h $MPIRUN -n $r ./floyd --backend=mpi+threads $((p / r)) $file
+		fi
+	done
+}
+
+if [ "$STUDY" = "strong" ] || [ "$STUDY" = "both" ]; then
+	if [ -n "$2" ]; then
+		FILE=$DIR$2
+		# width and height are the 2nd and 3rd header tokens, on one line or
+		# several, with comments running to the end of their line
+		SIZE=`head -c 4096 $FILE | LC_ALL=C awk '{
+			sub(/#.*/, "")
+			for (i = 1; i <= NF; i++) {
+				if (++n == 2)
+					w = $i
+				else if (n == 3) {
+					print w "x" $i
+					exit
+				}
+			}
+		}'`
+	else
+		FILE=$TMP/strong.ppm
+		SIZE=$STRONG_SIZE
+		./synth ${SIZE%x*} ${SIZE#*x} $FILE
+	fi
+	W=${SIZE%x*}
+	H=${SIZE#*x}
+	run strong 1 1 $W $H ./floyd --backend=serial $FILE
+	for p in $WORKERS; do
+		configs strong $p $FILE $W $H
+	done
+	echo "strong scaling on ${W}x${H} finished"
+fi
+
+if [ "$STUDY" = "weak" ] || [ "$STUDY" = "both" ]; then
+	W=${WEAK_SIZE%x*}
+	for p in $WORKERS; do
+		H=$((${WEAK_SIZE#*x} * p))
+		FILE=$TMP/weak$p.ppm
+		./synth $W $H $FILE
+		run weak 1 1 $W $H ./floyd --backend=serial $FILE
+		configs weak $p $FILE $W $H
+		rm $FILE
+	done
+	echo "weak scaling from $WEAK_SIZE per worker finished"
+fi
+
+if [ ! -s $out_scaling ]; then
+	echo "study,backend,ranks,threads,workers,width,height,t1_ms,time_ms,speedup,efficiency,karp_flatt,serial_ms,vs_serial" \
+		> $out_scaling
+fi
+
+# label = study:ranks:threads:width:height; one-worker rows are the baselines
+awk -F, '
+	NR > 1 && ($3 == "compute" || $3 == "communicate") { t[$1 "," $2] += $8; n[$1 "," $2] = $6 }
+	END {
+		for (k in t) {
+			split(k, f, ","); split(f[1], l, ":")
+			if (f[2] == "Serial")
+				serial[l[1] ":" l[4] ":" l[5]] = t[k]
+			else if (l[2] * l[3] == 1) {
+				t1[l[1] ":" f[2]] = t[k]
+				n1[l[1] ":" f[2]] = n[k]
+			}
+		}
+		for (k in t) {
+			split(k, f, ","); split(f[1], l, ":")
+			b = l[1] ":" f[2]
+			if (f[2] == "Serial" || !(b in t1))
+				continue
+			p = l[2] * l[3]
+			s = t1[b] * (n[k] / n1[b]) / t[k]
+			kf = p > 1 ? sprintf("%.4f", (1 / s - 1 / p) / (1 - 1 / p)) : ""
+			printf "%s,%s,%d,%d,%d,%d,%d,%.3f,%.3f,%.4f,%.4f,%s,%.3f,%.4f\n", l[1], f[2], l[2], l[3], p,
+			       l[4], l[5], t1[b], t[k], s, s / p, kf, serial[l[1] ":" l[4] ":" l[5]],
+			       serial[l[1] ":" l[4] ":" l[5]] / t[k]
+		}
+	}' $DITHER_BENCH_OUT | sort -t, -k1,1r -k2,2 -k5,5n -k3,3n > $TMP/rows.csv
+cat $TMP/rows.csv >> $out_scaling
+
+(head -1 $out_scaling; cat $TMP/rows.csv) | tr ',' '\t'
+# strong: the fastest run, and the fastest that still uses its workers well;
+# weak: the most workers that still keep the efficiency up
+grep "^strong," $TMP/rows.csv | sort -t, -k9,9g | head -1 | \
+	awk -F, '{ printf "strong fastest: %s, %d ranks x %d threads, %.3f ms, E = %s\n", $2, $3, $4, $9, $11 }'
+grep "^strong," $TMP/rows.csv | awk -F, -v min=$MIN_EFFICIENCY '$11 >= min' | sort -t, -k9,9g | head -1 | \
+	awk -F, -v min=$MIN_EFFICIENCY '{ printf "strong sweet spot (E >= %s): %s, %d ranks x %d threads, %.3f ms, E = %s\n",
+	                                   min, $2, $3, $4, $9, $11 }'
+grep "^weak," $TMP/rows.csv | awk -F, -v min=$MIN_EFFICIENCY '$11 >= min' | sort -t, -k5,5nr -k11,11gr | head -1 | \
+	awk -F, -v min=$MIN_EFFICIENCY '{ printf "weak sweet spot (E >= %s): %s, %d ranks x %d threads, %.3f ms, E = %s\n",
+	                                   min, $2, $3, $4, $9, $11 }'
+echo "results appended to $out_scaling"
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "steal.h"
+#include "prof.h"
+
+#define pack(lo, hi) (((uint64_t)(uint32_t)(lo) << 32) | (uint32_t)(hi))
+#define unpack_lo(s) ((long)(uint32_t)((s) >> 32))
+#define unpack_hi(s) ((long)(uint32_t)(s))
+
+typedef struct {
+    _Atomic uint64_t range;
+    char pad[64 - sizeof(uint64_t)];
+} TileDeque;
+
+typedef struct {
+    int id, workers, steal;
+    TileDeque *deques;
+    TileFunc run;
+    void *arg;
+    long tiles, stolen;
+    double busy;
+} TStealParam;
+
+static long imbalance_us;
+
+static double now_ms(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+// the owner's end of the deque; -1 when empty
+static long pop_tile(TileDeque *deque) {
+    uint64_t s = atomic_load_explicit(&deque->range, memory_order_acquire);
+
+    while (unpack_lo(s) < unpack_hi(s)) {
+        if (atomic_compare_exchange_weak_explicit(&deque->range, &s,
+                pack(unpack_lo(s), unpack_hi(s) - 1), memory_order_acq_rel, memory_order_acquire))
+            return unpack_hi(s) - 1;
+    }
+    return -1;
+}
+
+// takes the front half of the victim's tiles into the (empty) own deque
+static int steal_tiles(TileDeque *victim, TileDeque *own) {
+    uint64_t s = atomic_load_explicit(&victim->range, memory_order_acquire);
+    long lo, take;
+
+    while (unpack_lo(s) < unpack_hi(s)) {
+        lo = unpack_lo(s);
+        take = (unpack_hi(s) - lo + 1) / 2;
+        if (atomic_compare_exchange_weak_explicit(&victim->range, &s, pack(lo + take, unpack_hi(s)),
+                memory_order_acq_rel, memory_order_acquire)) {
+            atomic_store_explicit(&own->range, pack(lo, lo + take), memory_order_release);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* steal_worker(void *params) {
+    TStealParam *p = (TStealParam*)params;
+    TileDeque *own = &p->deques[p->id];
+    double start = now_ms();
+    long tile;
+    int i, victim;
+
+    p->tiles = p->stolen = 0;
+    for (;;) {
+        while ((tile = pop_tile(own)) >= 0) {
+            p->run(p->arg, tile);
+            p->tiles++;
+        }
+        if (!p->steal)
+            break;
+
+        // tiles are only ever moved, never added: one empty sweep ends it
+        for (i = 1; i < p->workers; i++) {
+            victim = (p->id + i) % p->workers;
+            if (steal_tiles(&p->deques[victim], own)) {
+                p->stolen++;
+                break;
+            }
+        }
+        if (i == p->workers)
+            break;
+    }
+    p->busy = now_ms() - start;
+
+    return NULL;
+}
+
+void StealRun(ThreadPool *pool, int workers, long num_tiles, TileFunc run, void *arg) {
+    const char *steal = getenv("DITHER_STEAL");
+    TileDeque *deques;
+    TStealParam p[workers];
+    long share = (num_tiles + workers - 1) / workers, lo, hi;
+    int i;
+
+    imbalance_us = getenv("DITHER_IMBALANCE") ? atol(getenv("DITHER_IMBALANCE")) : 0;
+    deques = (TileDeque*)malloc(workers * sizeof(TileDeque));
+    if (!deques) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    for (i = 0; i < workers; i++) {
+        lo = i * share < num_tiles ? i * share : num_tiles;
+        hi = lo + share < num_tiles ? lo + share : num_tiles;
+        atomic_init(&deques[i].range, pack(lo, hi));
+    }
+
+    for (i = 0; i < workers; i++) {
+        p[i].id = i;
+        p[i].workers = workers;
+        p[i].steal = !(steal && strcmp(steal, "0") == 0);
+        p[i].deques = deques;
+        p[i].run = run;
+        p[i].arg = arg;
+        PoolSubmit(pool, &steal_worker, &p[i]);
+    }
+    PoolWait(pool);
+
+    // stderr, so run.sh still only sees the TIME line; only when profiling
+    for (i = 0; i < workers && prof_enabled; i++)
+        fprintf(stderr, "worker %d tiles = %ld steals = %ld busy = %lf\n",
+                i, p[i].tiles, p[i].stolen, p[i].busy);
+
+    free(deques);
+}
+
+void StealImbalance(long tile, long num_tiles) {
+    double until;
+
+    if (imbalance_us == 0 || tile >= num_tiles / 4)
+        return;
+
+    until = now_ms() + imbalance_us / 1000.0;
+    while (now_ms() < until) ;
+}
+
+typedef struct {
+    RGBTriple *pixels;
+    unsigned char *result;
+    RGBPalette palette;
+    int width, rows, tileRows;
+    long numTiles;
+} NearestTiles;
+
+static void nearest_tile(void *arg, long tile) {
+    NearestTiles *p = (NearestTiles*)arg;
+    int first = tile * p->tileRows;
+    int rows = first + p->tileRows < p->rows ? p->tileRows : p->rows - first;
+
+    StealImbalance(tile, p->numTiles);
+    DitherNearest(p->pixels + (long)first * p->width, (long)rows * p->width, p->palette,
+                  p->result + (long)first * p->width);
+}
+
+void StealDitherNearest(ThreadPool *pool, int workers, RGBTriple *pixels, unsigned char *result,
+                        RGBPalette palette, int width, int rows, int tileRows) {
+    NearestTiles p;
+
+    if (tileRows < 1)
+        tileRows = 1;
+    p.pixels = pixels;
+    p.result = result;
+    p.palette = palette;
+    p.width = width;
+    p.rows = rows;
+    p.tileRows = tileRows;
+    p.numTiles = (rows + tileRows - 1) / tileRows;
+    StealRun(pool, workers, p.numTiles, &nearest_tile, &p);
+}
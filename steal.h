@@ -0,0 +1,32 @@
+#ifndef STEAL_H
+#define STEAL_H
+
+#include "pool.h"
+
+// Work-stealing tile scheduler. Tiles [0, num_tiles) are dealt out to the
+// workers in contiguous ranges, one range per worker deque. A worker runs
+// tiles from the back of its own deque; once that is empty it steals the
+// front half of another worker's deque. With DITHER_STEAL=0 nobody steals,
+// which is plain static partitioning over the same tiles.
+//
+// Each deque is a [lo, hi) pair packed into one atomic word: the owner
+// takes tiles by lowering hi and thieves by raising lo, both with a CAS.
+typedef void (*TileFunc)(void *arg, long tile);
+
+#define DEFAULT_TILE_ROWS 4
+
+// runs every tile once on `workers` jobs of the pool (which needs at least
+// that many threads); with DITHER_PROF it prints per-worker tile counts on stderr
+void StealRun(ThreadPool *pool, int workers, long num_tiles, TileFunc run, void *arg);
+
+// DITHER_IMBALANCE=<us> makes every tile in the first quarter busy-wait that
+// long, to show what stealing gains over static partitioning
+void StealImbalance(long tile, long num_tiles);
+
+// maps `rows` rows of `width` pixels to their nearest palette colours, in
+// tiles of tileRows rows (at least 1) run by StealRun, each delayed by
+// StealImbalance
+void StealDitherNearest(ThreadPool *pool, int workers, RGBTriple *pixels, unsigned char *result,
+                        RGBPalette palette, int width, int rows, int tileRows);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "dither.h"
+#include "ppm.h"
+
+// Synthetic inputs for the scaling study (scaling.sh): smooth gradients, so
+// the palette search sees the spread of colours a photograph would, plus a
+// little hashed noise, so no two rows dither the same. The same size and
+// seed always give the same image.
+
+// 32-bit integer hash (lowbias32)
+static unsigned int hash(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static unsigned char channel(double value, unsigned int noise) {
+    value += (int)(noise & 31) - 16;
+    if (value < 0)
+        return 0;
+    if (value > 255)
+        return 255;
+    return (unsigned char)value;
+}
+
+int main(int argc, char* argv[]) {
+    RGBImage image;
+    unsigned int seed, noise;
+    double u, v;
+    long k;
+    int x, y;
+
+    if (argc < 4 || argc > 5) {
+        printf("call <synth> width height output [seed]\n");
+        exit(1);
+    }
+
+    image.width = atoi(argv[1]);
+    image.height = atoi(argv[2]);
+    seed = argc > 4 ? (unsigned int)atoi(argv[4]) : 1;
+    if (image.width < 1 || image.height < 1) {
+         fprintf(stderr, "Invalid image size %sx%s\n", argv[1], argv[2]);
+         exit(1);
+    }
+
+    image.pixels = (RGBTriple*)malloc((long)image.width * image.height * sizeof(RGBTriple));
+    if (!image.pixels) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+    }
+
+    for (y = 0; y < image.height; y++) {
+        // the pattern repeats every 1024 rows, so a taller image is the same
+        // work per row and weak scaling only adds rows
+        v = (y % 1024) / 1024.0;
+        for (x = 0; x < image.width; x++) {
+            u = (double)x / image.width;
+            k = (long)y * image.width + x;
+            noise = hash((unsigned int)k ^ hash(seed));
+            image.pixels[k].R = channel(255 * u, noise);
+            image.pixels[k].G = channel(127.5 + 127.5 * sin(6.2831853 * (u + v)), noise >> 8);
+            image.pixels[k].B = channel(255 * v * (1 - u), noise >> 16);
+        }
+    }
+
+    writePPM(argv[3], &image);
+    free(image.pixels);
+
+    return 0;
+}
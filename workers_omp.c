@@ -0,0 +1,12 @@
+#include <omp.h>
+
+#include "dither.h"
+
+void RunWorkersOMP(int workers, WorkFunc work, void *arg) {
+    int id;
+
+    // a smaller team than asked for still runs every id
+    #pragma omp parallel for num_threads(workers) schedule(static, 1)
+    for (id = 0; id < workers; id++)
+        work(arg, id);
+}